@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class AssetCache {
+    // Decoded assets shared by every model that asks for the same
+    // file. An asset is keyed by a kind, which also tells apart ways of
+    // loading one file, and the file's canonical path. It is reloaded
+    // if the file's modification time changes. Callers hold shared
+    // handles, so an asset stays alive while any of them uses it.
+    // The cache keeps its own handles to at most budget bytes of
+    // assets. Past that, it drops the least recently used assets that
+    // no caller holds. Safe to use from several threads. A second
+    // request for an asset still loading waits for the first one.
+    public:
+        struct Stats {
+            std::size_t hits{0};
+            std::size_t misses{0};
+            std::size_t evictions{0};
+            std::size_t bytes{0};
+        };
+    private:
+        using Loaded = std::pair<std::shared_ptr<const void>, std::size_t>;
+        struct Entry {
+            std::shared_future<std::shared_ptr<const void>> asset;
+            long long mtime;
+            std::size_t bytes;
+            std::list<std::string>::iterator recent;
+        };
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        // Keys from most to least recently used
+        std::list<std::string> recency;
+        std::size_t budget;
+        Stats stats;
+        std::shared_ptr<const void> get_any(const std::string &kind, const char *filename,
+                                            const std::function<Loaded(const std::string &path)> &load);
+        void evict();
+    public:
+        explicit AssetCache(std::size_t budget=std::size_t(512) << 20);
+        AssetCache(const AssetCache&) = delete;
+        AssetCache & operator =(const AssetCache&) = delete;
+        void set_budget(std::size_t bytes);
+        Stats get_stats();
+
+        // Returns the cached T for filename, or load(path) of it. T must
+        // have a memory_size() to charge against the budget. A file
+        // that cannot be found is loaded every time, without caching.
+        template <class T>
+        std::shared_ptr<const T> get(const std::string &kind, const char *filename,
+                                     const std::function<std::shared_ptr<const T>(const std::string &path)> &load) {
+            return std::static_pointer_cast<const T>(get_any(kind, filename, [&](const std::string &path) {
+                std::shared_ptr<const T> asset = load(path);
+                return Loaded(asset, asset ? asset->memory_size() : 0);
+            }));
+        }
+};
+
+// The cache models load their meshes and textures through, created on first use
+AssetCache& asset_cache();
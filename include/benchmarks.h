@@ -0,0 +1,27 @@
+#pragma once
+
+#include "depth_buffer.h"
+#include "geometry.h"
+#include "model.h"
+
+// Timings of parts of the renderer, which main runs after the frame
+// when they are named on the command line. Each prints its results.
+
+// Every shader in shaders.h over the model, seen from camera as in the
+// final pass, through the templated and the virtual draw path
+void benchmark_shaders(Model *model, const DepthBuffer &shadow_depth, const Matrix &MShadow,
+                       Vector3d camera, Vector3d origin, Vector3d upwards);
+
+// The closed-form 4x4 inverse against the generic adjugate one, on
+// general and on affine matrices
+void benchmark_inverse();
+
+// Texel fetches from row-major and tiled copies of the texture in
+// filename: column by column, the worst case for row-major storage,
+// and bilinear samples along lines of random direction, as a
+// triangle's footprint would take them
+void benchmark_textures(const char *filename);
+
+// Decoding filename over and over, after one read to warm the page
+// cache, in MB/s of file read and of pixels written
+void benchmark_tga_decode(const char *filename);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include "tgaimage.h"
+
+class DepthBuffer {
+    // A z-buffer of floats stored row-major in one contiguous block.
+    // Larger depths are nearer the camera; a fragment passes the
+    // depth test if it is at least as near as what is stored.
+    // test() and set() are unchecked, the rasterizer only calls them
+    // inside the buffer; get() returns 0 outside it.
+    private:
+        int width;
+        int height;
+        std::vector<float> data;
+    public:
+        DepthBuffer(int w, int h, float clear_value=0.f);
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+        const float *buffer() const { return data.data(); }
+
+        float get(int x, int y) const {
+            if (x<0 || y<0 || x>=width || y>=height) {
+                return 0.f;
+            }
+            return data[x+y*width];
+        }
+
+        bool test(int x, int y, double depth) const {
+            return data[x+y*width] <= depth;
+        }
+
+        void set(int x, int y, double depth) {
+            data[x+y*width] = static_cast<float>(depth);
+        }
+
+        void clear(float value=0.f);
+        TGAImage to_image(double max_depth) const;
+};
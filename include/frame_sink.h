@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+class FrameSink {
+    // Streams rendered frames one after another into a single file,
+    // named pipe or stdout, for a video encoder to read as they come,
+    // e.g. ffmpeg -f rawvideo -pixel_format bgr24 -video_size 800x800 -i -
+    // Every frame is converted into one buffer and written in one go;
+    // nothing is created per frame.
+    public:
+        enum Format {
+            RAW_BGR,    // bare 8 bit BGR pixels, as TGA stores them
+            RAW_RGB,    // bare 8 bit RGB pixels
+            PPM,        // a binary PPM image per frame
+            Y4M         // YUV4MPEG2, 4:4:4 BT.601 studio range
+        };
+    private:
+        std::FILE *out{nullptr};
+        bool owns_out{false};
+        Format format;
+        int fps;
+        int width{0};
+        int height{0};
+        std::vector<unsigned char> frame;
+        std::vector<char> out_buffer;
+        void convert(const TGAImage &image, bool bottom_up);
+    public:
+        // path "-" streams to stdout. Opening a named pipe waits for
+        // its reader. fps only goes into the Y4M header.
+        FrameSink(const char *path, Format format, int fps=25);
+        ~FrameSink();
+        FrameSink(const FrameSink&) = delete;
+        FrameSink & operator =(const FrameSink&) = delete;
+        bool is_open() const { return out != nullptr; }
+        // Appends image as the next frame, top row first; bottom_up
+        // says its first row in memory is the bottom one, as for
+        // write_tga_file. Every frame must be the size of the first.
+        bool write(const TGAImage &image, bool bottom_up=false);
+        bool flush();
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+#include "thread_pool.h"
+
+class GBuffer {
+    // The surface attributes of the nearest fragment at each pixel,
+    // written by the geometry pass of deferred shading and lit once
+    // per pixel by resolve_gbuffer. Depth is kept in the DepthBuffer
+    // the geometry pass tests against, and the texture LOD is the one
+    // forward shading would sample at. Pixels no fragment reached hold
+    // EMPTY as their model id.
+    private:
+        int width;
+        int height;
+        std::vector<int> model_ids;
+        std::vector<Vector2r> uvs;
+        std::vector<real> uv_lods;
+        std::vector<Vector3r> points;
+    public:
+        static constexpr int EMPTY = -1;
+        GBuffer(int w, int h);
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+
+        void set(int x, int y, int model_id, Vector2r uv, real uv_lod, Vector3r point) {
+            model_ids[x+y*width] = model_id;
+            uvs[x+y*width] = uv;
+            uv_lods[x+y*width] = uv_lod;
+            points[x+y*width] = point;
+        }
+
+        int model_id(int x, int y) const { return model_ids[x+y*width]; }
+        Vector2r uv(int x, int y) const { return uvs[x+y*width]; }
+        real uv_lod(int x, int y) const { return uv_lods[x+y*width]; }
+        Vector3r point(int x, int y) const { return points[x+y*width]; }
+        void clear();
+};
+
+template <class Shader>
+void resolve_gbuffer(const GBuffer &gbuffer, const std::vector<Shader> &materials, TGAImage &image) {
+    // Lights every covered pixel exactly once with the shader of the
+    // model that wrote it, splitting the rows across the render pool.
+    // materials is indexed by model id, and each shader's shade()
+    // must only read its own uniforms.
+    render_pool().parallel_for(gbuffer.get_height(), [&](int pix_y, int) {
+        for (int pix_x = 0; pix_x < gbuffer.get_width(); ++pix_x) {
+            int model_id = gbuffer.model_id(pix_x, pix_y);
+            if (model_id == GBuffer::EMPTY) {
+                continue;
+            }
+            TGAColor color = materials[model_id].shade(gbuffer.point(pix_x, pix_y), gbuffer.uv(pix_x, pix_y),
+                                                       gbuffer.uv_lod(pix_x, pix_y));
+            image.set(pix_x, pix_y, color);
+        }
+    });
+}
@@ -4,11 +4,16 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#if defined(TINYRENDERER_SIMD_AVX) || defined(TINYRENDERER_SIMD_SSE)
+#include <xmmintrin.h>
+#define TINYRENDERER_SIMD_VEC4F
+#endif
 
 template<size_t DimCols,size_t DimRows,typename T> class mat;
 
 template <size_t DIM, typename T> struct vec {
     vec() { for (size_t i=DIM; i--; data_[i] = T()); }
+    template <class U> vec(const vec<DIM,U> &v) { for (size_t i=DIM; i--; data_[i] = static_cast<T>(v[i])); }
           T& operator[](const size_t i)       { assert(i<DIM); return data_[i]; }
     const T& operator[](const size_t i) const { assert(i<DIM); return data_[i]; }
 private:
@@ -21,10 +26,14 @@ template <typename T> struct vec<2,T> {
     vec() : x(T()), y(T()) {}
     vec(T X, T Y) : x(X), y(Y) {}
     template <class U> vec<2,T>(const vec<2,U> &v);
-          T& operator[](const size_t i)       { assert(i<2); return i<=0 ? x : y; }
-    const T& operator[](const size_t i) const { assert(i<2); return i<=0 ? x : y; }
+          T& operator[](const size_t i)       { assert(i<2); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<2); return this->*members[i]; }
     double norm() { return std::sqrt(x*x+y*y); }
     T x,y;
+private:
+    // Indexing goes through a table rather than a chain of
+    // conditionals, so a loop over the components can be vectorized
+    static constexpr T vec::*members[2] = {&vec::x, &vec::y};
 };
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -33,14 +42,59 @@ template <typename T> struct vec<3,T> {
     vec() : x(T()), y(T()), z(T()) {}
     vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
     template <class U> vec<3,T>(const vec<3,U> &v);
-          T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
+          T& operator[](const size_t i)       { assert(i<3); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<3); return this->*members[i]; }
     double norm() { return std::sqrt(x*x+y*y+z*z); }
     vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
 
     T x,y,z;
+private:
+    static constexpr T vec::*members[3] = {&vec::x, &vec::y, &vec::z};
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifdef TINYRENDERER_SIMD_VEC4F
+template <> struct vec<4,float> {
+    // Kept 16-byte aligned so it loads into one SSE register.
+    // The operators below that take it go through packed math.
+    vec() : data_() {}
+    template <class U> vec(const vec<4,U> &v) { for (size_t i=4; i--; data_[i] = static_cast<float>(v[i])); }
+          float& operator[](const size_t i)       { assert(i<4); return data_[i]; }
+    const float& operator[](const size_t i) const { assert(i<4); return data_[i]; }
+    __m128 load() const { return _mm_load_ps(data_); }
+    void store(__m128 v) { _mm_store_ps(data_, v); }
+    double norm() const;
+    vec<4,float> & normalize(float l=1) { store(_mm_mul_ps(load(), _mm_set1_ps(l/norm()))); return *this; }
+private:
+    alignas(16) float data_[4];
 };
 
+inline float operator*(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    // Adds the products from the last to the first, onto zero, as the
+    // generic dot product does
+    __m128 products = _mm_mul_ps(lhs.load(), rhs.load());
+    __m128 sum = _mm_add_ss(_mm_setzero_ps(), _mm_shuffle_ps(products, products, 3));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(products, products, 2));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(products, products, 1));
+    return _mm_cvtss_f32(_mm_add_ss(sum, products));
+}
+
+inline double vec<4,float>::norm() const {
+    return std::sqrt((*this)*(*this));
+}
+
+inline vec<4,float> operator+(vec<4,float> lhs, const vec<4,float>& rhs) {
+    lhs.store(_mm_add_ps(lhs.load(), rhs.load()));
+    return lhs;
+}
+
+inline vec<4,float> operator-(vec<4,float> lhs, const vec<4,float>& rhs) {
+    lhs.store(_mm_sub_ps(lhs.load(), rhs.load()));
+    return lhs;
+}
+#endif
+
 /////////////////////////////////////////////////////////////////////////////////
 
 template<size_t DIM,typename T> T operator*(const vec<DIM,T>& lhs, const vec<DIM,T>& rhs) {
@@ -111,10 +165,110 @@ template<typename T> struct dt<1,T> {
 
 /////////////////////////////////////////////////////////////////////////////////
 
+template<size_t DIM,typename T> struct inverse {
+    // Inverts through the adjugate, building every cofactor from its minor
+    static mat<DIM,DIM,T> invert_transpose(const mat<DIM,DIM,T>& src) {
+        mat<DIM,DIM,T> ret = src.adjugate();
+        T tmp = ret[0]*src[0];
+        return ret/tmp;
+    }
+
+    static mat<DIM,DIM,T> invert(const mat<DIM,DIM,T>& src) {
+        return invert_transpose(src).transpose();
+    }
+};
+
+template<typename T> struct inverse<4,T> {
+    // Closed form for 4x4: every cofactor is a combination of the six
+    // 2x2 minors of the top two rows and the six of the bottom two, so
+    // there are no branches and no minor matrices to copy.
+    // Affine matrices, with a bottom row of 0 0 0 1, only need the
+    // upper 3x3 inverted and take a shorter path.
+    static mat<4,4,T> invert_transpose(const mat<4,4,T>& src) {
+        return is_affine(src) ? affine<true>(src) : general<true>(src);
+    }
+
+    static mat<4,4,T> invert(const mat<4,4,T>& src) {
+        return is_affine(src) ? affine<false>(src) : general<false>(src);
+    }
+
+    static bool is_affine(const mat<4,4,T>& m) {
+        return m[3][0] == 0 && m[3][1] == 0 && m[3][2] == 0 && m[3][3] == 1;
+    }
+
+    template <bool Transposed> static void put(mat<4,4,T>& m, size_t row, size_t col, T value) {
+        if (Transposed) m[col][row] = value; else m[row][col] = value;
+    }
+
+    template <bool Transposed> static mat<4,4,T> general(const mat<4,4,T>& m) {
+        T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1];
+        T s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2];
+        T s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+        T s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2];
+        T s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3];
+        T s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+        T c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+        T c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2];
+        T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3];
+        T c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+        T c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3];
+        T c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3];
+        T inv_det = T(1) / (s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+
+        mat<4,4,T> ret;
+        put<Transposed>(ret, 0, 0, ( m[1][1]*c5 - m[1][2]*c4 + m[1][3]*c3) * inv_det);
+        put<Transposed>(ret, 0, 1, (-m[0][1]*c5 + m[0][2]*c4 - m[0][3]*c3) * inv_det);
+        put<Transposed>(ret, 0, 2, ( m[3][1]*s5 - m[3][2]*s4 + m[3][3]*s3) * inv_det);
+        put<Transposed>(ret, 0, 3, (-m[2][1]*s5 + m[2][2]*s4 - m[2][3]*s3) * inv_det);
+        put<Transposed>(ret, 1, 0, (-m[1][0]*c5 + m[1][2]*c2 - m[1][3]*c1) * inv_det);
+        put<Transposed>(ret, 1, 1, ( m[0][0]*c5 - m[0][2]*c2 + m[0][3]*c1) * inv_det);
+        put<Transposed>(ret, 1, 2, (-m[3][0]*s5 + m[3][2]*s2 - m[3][3]*s1) * inv_det);
+        put<Transposed>(ret, 1, 3, ( m[2][0]*s5 - m[2][2]*s2 + m[2][3]*s1) * inv_det);
+        put<Transposed>(ret, 2, 0, ( m[1][0]*c4 - m[1][1]*c2 + m[1][3]*c0) * inv_det);
+        put<Transposed>(ret, 2, 1, (-m[0][0]*c4 + m[0][1]*c2 - m[0][3]*c0) * inv_det);
+        put<Transposed>(ret, 2, 2, ( m[3][0]*s4 - m[3][1]*s2 + m[3][3]*s0) * inv_det);
+        put<Transposed>(ret, 2, 3, (-m[2][0]*s4 + m[2][1]*s2 - m[2][3]*s0) * inv_det);
+        put<Transposed>(ret, 3, 0, (-m[1][0]*c3 + m[1][1]*c1 - m[1][2]*c0) * inv_det);
+        put<Transposed>(ret, 3, 1, ( m[0][0]*c3 - m[0][1]*c1 + m[0][2]*c0) * inv_det);
+        put<Transposed>(ret, 3, 2, (-m[3][0]*s3 + m[3][1]*s1 - m[3][2]*s0) * inv_det);
+        put<Transposed>(ret, 3, 3, ( m[2][0]*s3 - m[2][1]*s1 + m[2][2]*s0) * inv_det);
+        return ret;
+    }
+
+    template <bool Transposed> static mat<4,4,T> affine(const mat<4,4,T>& m) {
+        // [A t; 0 1] inverts to [A^-1  -A^-1 t; 0 1]
+        T a00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+        T a01 = m[0][2]*m[2][1] - m[0][1]*m[2][2];
+        T a02 = m[0][1]*m[1][2] - m[0][2]*m[1][1];
+        T a10 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+        T a11 = m[0][0]*m[2][2] - m[0][2]*m[2][0];
+        T a12 = m[0][2]*m[1][0] - m[0][0]*m[1][2];
+        T a20 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+        T a21 = m[0][1]*m[2][0] - m[0][0]*m[2][1];
+        T a22 = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+        T inv_det = T(1) / (m[0][0]*a00 + m[0][1]*a10 + m[0][2]*a20);
+        T upper[3][3] = {{a00*inv_det, a01*inv_det, a02*inv_det},
+                         {a10*inv_det, a11*inv_det, a12*inv_det},
+                         {a20*inv_det, a21*inv_det, a22*inv_det}};
+
+        mat<4,4,T> ret;
+        for (size_t i=3; i--; ) {
+            for (size_t j=3; j--; put<Transposed>(ret, i, j, upper[i][j]));
+            put<Transposed>(ret, i, 3, -(upper[i][0]*m[0][3] + upper[i][1]*m[1][3] + upper[i][2]*m[2][3]));
+            put<Transposed>(ret, 3, i, T(0));
+        }
+        put<Transposed>(ret, 3, 3, T(1));
+        return ret;
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
 template<size_t DimRows,size_t DimCols,typename T> class mat {
     vec<DimCols,T> rows[DimRows];
 public:
     mat() {}
+    template <class U> mat(const mat<DimRows,DimCols,U> &m) { for (size_t i=DimRows; i--; rows[i]=vec<DimCols,T>(m[i])); }
 
     vec<DimCols,T>& operator[] (const size_t idx) {
         assert(idx<DimRows);
@@ -167,17 +321,15 @@ public:
         return ret;
     }
 
-    mat<DimRows,DimCols,T> invert_transpose() {
-        mat<DimRows,DimCols,T> ret = adjugate();
-        T tmp = ret[0]*rows[0];
-        return ret/tmp;
+    mat<DimRows,DimCols,T> invert_transpose() const {
+        return inverse<DimCols,T>::invert_transpose(*this);
     }
 
-    mat<DimRows,DimCols,T> invert() {
-        return invert_transpose().transpose();
+    mat<DimRows,DimCols,T> invert() const {
+        return inverse<DimCols,T>::invert(*this);
     }
 
-    mat<DimCols,DimRows,T> transpose() {
+    mat<DimCols,DimRows,T> transpose() const {
         mat<DimCols,DimRows,T> ret;
         for (size_t i=DimCols; i--; ret[i]=this->col(i));
         return ret;
@@ -209,6 +361,32 @@ template <size_t DimRows,size_t DimCols,class T> std::ostream& operator<<(std::o
     return out;
 }
 
+#ifdef TINYRENDERER_SIMD_VEC4F
+// Packed versions of the 4x4 float products. Each output component
+// sums its terms in the same order as the generic versions above,
+// so they give the same results.
+
+inline vec<4,float> operator*(const mat<4,4,float>& lhs, const vec<4,float>& rhs) {
+    __m128 rows[4] = {lhs[0].load(), lhs[1].load(), lhs[2].load(), lhs[3].load()};
+    _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+    __m128 ret = _mm_mul_ps(rows[3], _mm_set1_ps(rhs[3]));
+    for (size_t i=3; i--; ret = _mm_add_ps(ret, _mm_mul_ps(rows[i], _mm_set1_ps(rhs[i]))));
+    vec<4,float> result;
+    result.store(ret);
+    return result;
+}
+
+inline mat<4,4,float> operator*(const mat<4,4,float>& lhs, const mat<4,4,float>& rhs) {
+    mat<4,4,float> result;
+    for (size_t i=4; i--; ) {
+        __m128 row = _mm_mul_ps(rhs[3].load(), _mm_set1_ps(lhs[i][3]));
+        for (size_t k=3; k--; row = _mm_add_ps(row, _mm_mul_ps(rhs[k].load(), _mm_set1_ps(lhs[i][k]))));
+        result[i].store(row);
+    }
+    return result;
+}
+#endif
+
 /////////////////////////////////////////////////////////////////////////////////
 
 typedef vec<2,  double> Vector2d;
@@ -217,4 +395,21 @@ typedef vec<3,  double> Vector3d;
 typedef vec<3,  int>    Vector3i;
 typedef vec<4,  double> Vector4d;
 typedef mat<4,4,double> Matrix;
+typedef vec<2,  float>  Vector2f;
+typedef vec<3,  float>  Vector3f;
+typedef vec<4,  float>  Vector4f;
+typedef mat<4,4,float>  Matrixf;
+
+// The precision shaders and models work in, chosen at build time
+// through TINYRENDERER_PRECISION in CMakeLists.txt. The rasterizer
+// and depth tests stay in double either way.
+#ifdef TINYRENDERER_FLOAT_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+typedef vec<2,  real>   Vector2r;
+typedef vec<3,  real>   Vector3r;
+typedef vec<4,  real>   Vector4r;
+typedef mat<4,4,real>   Matrixr;
 #endif //__GEOMETRY_H__
\ No newline at end of file
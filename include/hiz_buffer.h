@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "depth_buffer.h"
+
+const int HIZ_BLOCK_SIZE = 8;
+
+class HiZBuffer {
+    // Coarse depth kept alongside a z-buffer: for every
+    // HIZ_BLOCK_SIZE x HIZ_BLOCK_SIZE block, the farthest (smallest)
+    // and nearest (largest) depth stored in it. Stored depths only
+    // ever grow, so a block whose farthest depth is in front of
+    // everything a triangle can reach can be skipped without
+    // visiting its pixels.
+    // The farthest depth is refreshed lazily: writes only mark the
+    // block dirty, and it is rescanned when a test needs it.
+    private:
+        const DepthBuffer *zbuffer;
+        int blocks_x;
+        int blocks_y;
+        std::vector<double> block_farthest;
+        std::vector<double> block_nearest;
+        std::vector<char> dirty;
+        std::atomic<long> rejected_triangles{0};
+        std::atomic<long> rejected_blocks{0};
+        std::atomic<long> skipped_pixels{0};
+        void refresh(int block);
+    public:
+        explicit HiZBuffer(const DepthBuffer &zbuffer);
+        HiZBuffer(const HiZBuffer&) = delete;
+        HiZBuffer & operator =(const HiZBuffer&) = delete;
+        void clear();
+        void record_write(int block_x, int block_y, double depth);
+        bool occludes(int block_x, int block_y, double nearest_depth);
+        double farthest(int block_x, int block_y);
+        double nearest(int block_x, int block_y);
+        void count_rejections(long blocks, long pixels, bool whole_triangle);
+        long get_rejected_triangles() const;
+        long get_rejected_blocks() const;
+        long get_skipped_pixels() const;
+        void reset_stats();
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "tgaimage.h"
+#include "thread_pool.h"
+
+class ImageWriter {
+    // Writes TGA files on a background thread, in the order they were
+    // queued, so the renderer can go on with the next frame. Each image
+    // is RLE encoded in bands of rows on the writer's own pool and the
+    // bands are written out in one go.
+    private:
+        struct Job {
+            TGAImage image;
+            std::string filename;
+            bool rle;
+            bool bottom_up;
+        };
+        ThreadPool encoders;
+        std::mutex mutex;
+        std::condition_variable job_ready;
+        std::condition_variable idle;
+        std::deque<Job> jobs;
+        bool writing{false};
+        bool stopping{false};
+        bool failed{false};
+        std::thread worker;
+        void worker_loop();
+        bool write_job(const Job &job);
+    public:
+        // nencoders as for ThreadPool
+        explicit ImageWriter(int nencoders=0);
+        ~ImageWriter();
+        ImageWriter(const ImageWriter&) = delete;
+        ImageWriter & operator =(const ImageWriter&) = delete;
+        // Queues an image to be written as by TGAImage::write_tga_file;
+        // move it in to save a copy
+        void write(TGAImage image, std::string filename, bool rle=true, bool bottom_up=false);
+        // Waits until every queued image is written, and tells whether
+        // all writes since the last flush succeeded
+        bool flush();
+};
+
+// The writer the renderer queues its output images on, created on first use
+ImageWriter& image_writer();
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+    // A whole file mapped read-only into memory, or read into a buffer
+    // where mmap is not available. data() is null if the file could not
+    // be opened; an empty file maps to a non-null pointer and size 0.
+    public:
+        // How the mapping will be read, for the kernel's paging
+        enum Access {
+            SEQUENTIAL, // once, front to back, as when decoding
+            RANDOM      // anywhere, for as long as it is held
+        };
+    private:
+        const char *mapping{nullptr};
+        std::size_t length{0};
+        std::string buffer;
+    public:
+        explicit MappedFile(const char *filename, Access access=SEQUENTIAL);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile & operator =(const MappedFile&) = delete;
+        const char *data() const { return mapping; }
+        std::size_t size() const { return length; }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "mapped_file.h"
+#include "mesh_optimizer.h"
+
+template <class T>
+class MeshArray {
+    // A read-only array a Model either owns, after parsing an OBJ, or
+    // borrows in place from a mapped mesh cache
+    private:
+        std::vector<T> owned;
+        const T *items{nullptr};
+        std::size_t count{0};
+    public:
+        void assign(std::vector<T> &&values) {
+            owned = std::move(values);
+            items = owned.data();
+            count = owned.size();
+        }
+        void borrow(const T *values, std::size_t n) {
+            owned.clear();
+            items = values;
+            count = n;
+        }
+        const T &operator[](std::size_t i) const { return items[i]; }
+        const T *data() const { return items; }
+        std::size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+};
+
+enum MeshArrayId {
+    MESH_VERTICES, MESH_INDICES, MESH_ARRAYS
+};
+
+struct MeshSourceStamp {
+    // The size and modification time of the OBJ a mesh cache was made
+    // from, compared before anything is read from the OBJ
+    std::uint64_t size;
+    std::int64_t mtime;
+    bool operator==(const MeshSourceStamp &other) const { return size == other.size && mtime == other.mtime; }
+};
+
+struct MeshCacheHeader {
+    // A mesh cache is this header followed by the arrays, each at a
+    // 16 byte aligned offset, in native byte order. It is only used
+    // if version and real_size match this build and optimization the
+    // MeshOptimization flags asked for, and the OBJ still has
+    // source_stamp or, failing that, its size and source_checksum.
+    static const std::uint32_t VERSION = 4;
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t real_size;
+    std::uint64_t source_checksum;
+    MeshSourceStamp source_stamp;
+    std::uint32_t optimization;
+    std::uint32_t reserved;
+    // compute_acmr of the triangles in OBJ order, before optimization
+    double original_acmr;
+    std::uint64_t counts[MESH_ARRAYS];
+    std::uint64_t offsets[MESH_ARRAYS];
+};
+
+std::uint64_t checksum_bytes(const char *data, std::size_t size);
+
+// Where mesh_cache_path puts the caches. It defaults to
+// $XDG_CACHE_HOME/tinyrenderer or ~/.cache/tinyrenderer; empty puts
+// each cache next to its OBJ.
+void set_mesh_cache_directory(const std::string &directory);
+std::string mesh_cache_directory();
+
+// The mesh cache file for the OBJ source_file, creating the cache
+// directory if needed. Caches of OBJ files with the same name in
+// different directories get different names.
+std::string mesh_cache_path(const std::string &source_file);
+
+class MeshCache {
+    // A mesh cache mapped read-only. Models point into it, so it must
+    // outlive the arrays borrowed from it.
+    private:
+        MappedFile file;
+        const MeshCacheHeader *header{nullptr};
+    public:
+        // Maps filename if it is a cache of this build with these
+        // MeshOptimization flags; whether it matches the OBJ is up to
+        // the caller
+        MeshCache(const char *filename, unsigned optimization);
+        bool is_valid() const { return header != nullptr; }
+        const MeshSourceStamp &source_stamp() const { return header->source_stamp; }
+        std::uint64_t source_checksum() const { return header->source_checksum; }
+        double original_acmr() const { return header->original_acmr; }
+        template <class T>
+        void lend(MeshArrayId id, MeshArray<T> &array) const {
+            array.borrow(reinterpret_cast<const T *>(file.data() + header->offsets[id]), header->counts[id]);
+        }
+};
+
+struct MeshCacheContents {
+    // What a model keeps of an OBJ, as written to a mesh cache
+    unsigned optimization;
+    double original_acmr;
+    const MeshArray<MeshVertex> &vertices;
+    const MeshArray<std::uint32_t> &indices;
+};
+
+bool write_mesh_cache(const char *filename, const MeshSourceStamp &source_stamp, std::uint64_t source_checksum,
+                      const MeshCacheContents &contents);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+struct MeshVertex {
+    // One vertex of a model's interleaved vertex stream: a distinct
+    // position / uv / normal combination from the OBJ
+    Vector3r position;
+    Vector2r uv;
+    Vector3r normal; // Unit length
+};
+
+enum MeshOptimization {
+    // Load-time passes over a model's triangles, combined as bit flags
+    OPTIMIZE_NONE = 0,
+    OPTIMIZE_VERTEX_CACHE = 1, // Reorder triangles to reuse recent vertices
+    OPTIMIZE_OVERDRAW = 2      // Then reorder clusters of them to draw outward-facing ones first
+};
+
+// The average cache misses per triangle of a FIFO post-transform
+// vertex cache of cache_size entries running over the index buffer
+double compute_acmr(const std::uint32_t *indices, std::size_t nindices, int cache_size=16);
+
+// Forsyth's linear-speed vertex cache optimization: greedily emits the
+// triangle whose vertices score highest in a simulated LRU cache
+void optimize_vertex_cache(std::vector<std::uint32_t> &indices, std::size_t nvertices);
+
+// Cuts the triangles into clusters of cluster_size in their current
+// order and sorts the clusters so that those facing away from the
+// mesh centre come first, as in Tipsify. Those tend to occlude the
+// others from any viewpoint, so fewer fragments get overwritten.
+void optimize_overdraw(std::vector<std::uint32_t> &indices, const std::vector<MeshVertex> &vertices,
+                       std::size_t cluster_size=64);
+
+// Renumbers the vertices in the order the triangles first use them,
+// so the vertex stage walks the vertex stream front to back
+void optimize_vertex_fetch(std::vector<std::uint32_t> &indices, std::vector<MeshVertex> &vertices);
@@ -1,36 +1,87 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "mesh_cache.h"
+#include "mesh_optimizer.h"
+
+enum TextureLoading {
+	// When a model reads its texture maps
+	TEXTURES_PARALLEL, // In the background while the OBJ is parsed, all done by the end of the constructor
+	TEXTURES_LAZY      // Each on its first sample, so maps no shader samples are never read
+};
+
+struct Mesh {
+	// The geometry of an OBJ, shared by every model loaded from it
+	// with the same optimization flags
+	// Each distinct position / uv / normal the faces use, welded once
+	MeshArray<MeshVertex> vertices;
+	// Triangle i is vertices indices[3*i] to indices[3*i+2]; polygons
+	// are split into triangles at load time
+	MeshArray<std::uint32_t> indices;
+	double original_acmr{0};
+	// Set when the arrays above are borrowed from a mesh cache
+	std::unique_ptr<MeshCache> cache;
+	std::size_t memory_size() const;
+};
+
 class Model {
+	// A mesh and its texture maps, all shared through asset_cache(),
+	// so models of the same files hold one copy of each
 private:
-	std::vector<Vector3d> verts_;
-	// The vector is vertex / uv / normal 
-	std::vector<std::vector<Vector3i> > faces_;
-	std::vector<Vector3d> norms_;
-	std::vector<Vector2d> uv_;
-	TGAImage diffusemap_;
-	TGAImage normalmap_;
-	TGAImage specularmap_;
-	TGAImage subsurfacemap_;
-	void load_texture(std::string filename, const char *suffix, TGAImage &image);
+	struct TextureMap {
+		// One of the model's texture maps, fetched at most once
+		explicit TextureMap(const char *suffix) : suffix(suffix) {}
+		const char *suffix;
+		std::shared_ptr<const Texture> texture;
+		std::once_flag once;
+		std::atomic<bool> loaded{false};
+	};
+	std::shared_ptr<const Mesh> mesh_;
+	std::string filename_;
+	Texture::Layout texture_layout_;
+	TextureMap diffusemap_;
+	TextureMap normalmap_;
+	TextureMap specularmap_;
+	TextureMap subsurfacemap_;
+	void load_texture(TextureMap &map);
+	const Texture &texture(TextureMap &map);
 public:
-	Model(const char *filename);
+	// With use_mesh_cache, the parsed OBJ is kept in binary form in
+	// mesh_cache_directory(), and later runs map that instead of parsing.
+	// optimization is a set of MeshOptimization flags. The texture maps
+	// are stored in texture_layout.
+	Model(const char *filename, bool use_mesh_cache=true, unsigned optimization=OPTIMIZE_VERTEX_CACHE,
+	      TextureLoading textures=TEXTURES_PARALLEL, Texture::Layout texture_layout=Texture::LINEAR);
+	Model(const Model&) = delete;
+	Model & operator =(const Model&) = delete;
 	~Model();
 	int nverts();
 	int nfaces();
-	Vector3d norm(int iface, int nvert);
-	Vector3d vert(int index);
-    Vector3d vert(int iface, int nthvert);
+	Vector3r norm(int iface, int nvert);
+	Vector3r vert(int index);
+    Vector3r vert(int iface, int nthvert);
+	int vert_index(int iface, int nthvert);
 
-	Vector2d uv(int iface, int nvert);
-	TGAColor diffuse(Vector2d uvf);
-	Vector3d normalmap(Vector2d uvf);
-    double specularmap(Vector2d uvf);
-    TGAColor subsurfacemap(Vector2d uvf);
-	std::vector<int> face(int index);
+	Vector2r uv(int iface, int nvert);
+	// uv_lod picks the mip level, see Texture::sample
+	TGAColor diffuse(Vector2r uvf, real uv_lod=MAGNIFIED);
+	Vector3r normalmap(Vector2r uvf, real uv_lod=MAGNIFIED);
+    double specularmap(Vector2r uvf, real uv_lod=MAGNIFIED);
+    TGAColor subsurfacemap(Vector2r uvf, real uv_lod=MAGNIFIED);
+	// The three vertex indices of a triangle, pointing into the model
+	const std::uint32_t *face(int index);
+	// Average cache misses per triangle, see compute_acmr, of the
+	// triangles as drawn and as they were in the OBJ
+	double acmr();
+	double original_acmr();
 };
 
 #endif //__MODEL_H__
@@ -1,14 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
 #include "shaders.h"
+#include "thread_pool.h"
+#include "hiz_buffer.h"
+#include "depth_buffer.h"
 extern const int MAX_DEPTH;
 extern const double GAMMA;
 extern const double AMBIENT;
 extern const int SCREEN_X;
 extern const int SCREEN_Y;
+const int TILE_SIZE = 64;
+// Tiles are drawn in parallel and must not share a hierarchical z block
+static_assert(TILE_SIZE % HIZ_BLOCK_SIZE == 0, "TILE_SIZE must be a multiple of HIZ_BLOCK_SIZE");
 
 extern Matrix ModelView;
 extern Matrix Viewport;
@@ -27,17 +37,177 @@ class Triangle{
 		Vector2i bounding_min;
 		Vector2i bounding_max;
 		double determinant;
-		template <class T>
-		Vector3d barycentric(T);
+		double inv_area;
+		Vector3d edge_step_x;
+		Vector3d edge_step_y;
+		Vector3d edge_bias;
+		void setup_edges();
+		Vector3d edges_at(int, int);
+#ifdef TINYRENDERER_FIXED_POINT
+		long long fixed_x[3];
+		long long fixed_y[3];
+		long long fixed_step_x[3];
+		long long fixed_bias[3];
+		long long orientation;
+		void fixed_edges_at(int, int, long long (&)[3]);
+#endif
+		Vector3d shader_barycentric(Vector3d);
+		void start_packet(FragmentPacket&, int pix_y);
+		void pack_fragment(FragmentPacket&, int lane, int pix_x, double depth, Vector3d bc_screen);
+		template <class Shader>
+		bool shade_packet(DepthBuffer&, TGAImage&, Shader&, const FragmentPacket&, double &nearest_written);
+		template <class Shader>
+		bool draw_span(DepthBuffer&, TGAImage&, Shader&, int pix_y, int first_x, int last_x,
+		               const double (&edge_values)[3][HIZ_BLOCK_SIZE], double &nearest_written);
 		Vector3d perspective_correct(Vector3d);
 		Vector4d screen_coords[3];
+		bool clipped;
+		mat<3, 3, double> parent_barycentric;
     public:
+		Triangle();
 		Triangle(Vector4d, Vector4d, Vector4d, TGAImage &image);
-		void draw_texture(TGAImage&, TGAImage&, IShader&);
+		void set_parent(mat<3, 3, double> barycentric_to_parent);
+		bool is_drawable() const;
+		Vector2i get_bounding_min() const;
+		Vector2i get_bounding_max() const;
+		// Instantiated in our_gl.cpp for IShader, which calls fragment()
+		// through the vtable, and for each final shader in shaders.h,
+		// whose fragment() is resolved and inlined at compile time.
+		template <class Shader>
+		void draw_texture(DepthBuffer&, TGAImage&, Shader&, HiZBuffer *hiz=nullptr);
+		template <class Shader>
+		void draw_texture(DepthBuffer&, TGAImage&, Shader&, Vector2i clip_min, Vector2i clip_max, HiZBuffer *hiz=nullptr);
 		void draw_outline(TGAImage&, TGAColor);
 		void draw_bounding_box(TGAImage&, TGAColor);
 };
 
+enum CullMode {
+    // Which screen-space winding gets discarded. With the y axis
+    // pointing up, front faces of an OBJ mesh are counter-clockwise.
+    CULL_NONE, CULL_CW, CULL_CCW
+};
+
+struct PrimitiveStats {
+    // Counts of input triangles dropped or split by assemble_triangle
+    std::atomic<long> culled{0};
+    std::atomic<long> rejected{0};
+    std::atomic<long> clipped{0};
+};
+
+std::vector<Vector4r> transform_vertices(Model &model, const Matrixr &transform);
+
+int assemble_triangle(const Vector4d (&vertices)[3], TGAImage &image, CullMode cull,
+                      Triangle (&out)[2], PrimitiveStats *stats=nullptr);
+
+class TileBins{
+    // Splits the framebuffer into TILE_SIZE x TILE_SIZE tiles and
+    // keeps, per tile, the faces whose bounding box overlaps it.
+    private:
+		int tiles_x;
+		int tiles_y;
+		std::vector<std::vector<int> > bins;
+    public:
+		TileBins(int width, int height);
+		void insert(int face, const Triangle&);
+		int ntiles() const;
+		const std::vector<int>& bin(int tile) const;
+		Vector2i tile_min(int tile) const;
+		Vector2i tile_max(int tile) const;
+};
+
+template <class Shader>
+void draw_faces(Shader &shader, int nfaces, DepthBuffer &zbuffer, TGAImage &image, HiZBuffer *hiz=nullptr,
+                CullMode cull=CULL_CW, PrimitiveStats *stats=nullptr) {
+    // Rasterizes faces [0, nfaces) one after another on this thread
+    for (int i=0; i < nfaces; ++i) {
+        Vector4d screen_coords[3];
+        for (int j = 0; j < 3; ++j){
+            // The vertex shader replaces the world to screen calculation
+            screen_coords[j] = shader.vertex(i, j);
+        }
+        Triangle triangles[2];
+        int ntriangles = assemble_triangle(screen_coords, image, cull, triangles, stats);
+        for (int k = 0; k < ntriangles; ++k) {
+            triangles[k].draw_texture(zbuffer, image, shader, hiz);
+        }
+    }
+}
+
+template <class Shader>
+void draw_faces_tiled(Shader &shader, int nfaces, DepthBuffer &zbuffer, TGAImage &image, HiZBuffer *hiz=nullptr,
+                      CullMode cull=CULL_CW, PrimitiveStats *stats=nullptr) {
+    // Rasterizes faces [0, nfaces) on the render pool.
+    // Faces are assembled in parallel from their screen coordinates,
+    // looked up in the shader's vertex buffer when it has one, binned
+    // into screen tiles in draw order, and then each tile is drawn by a
+    // single worker. vertex() only runs there, once per face and tile,
+    // to set the face's varyings.
+    // Tiles never share pixels, so the zbuffer and image need no locks,
+    // and the output matches draw_faces exactly. TILE_SIZE is a multiple
+    // of HIZ_BLOCK_SIZE, so no two tiles share a hierarchical z block either.
+    ThreadPool &pool = render_pool();
+    std::vector<Shader> shaders(pool.size(), shader);
+    // Slot i holds face i's triangle. Clipping against the near plane
+    // rarely splits a face in two; the second pieces go on their
+    // worker's overflow list instead of a second slot for every face.
+    std::vector<Triangle> triangles(nfaces);
+    std::vector<unsigned char> ntriangles(nfaces);
+    std::vector<std::vector<std::pair<int, Triangle> > > overflows(pool.size());
+    const int batch = 256;
+    pool.parallel_for((nfaces + batch - 1) / batch, [&](int task, int worker) {
+        for (int i = task * batch; i < std::min(nfaces, (task + 1) * batch); ++i) {
+            Vector4d screen_coords[3];
+            for (int j = 0; j < 3; ++j){
+                screen_coords[j] = shader.transform(shader.model, i, j);
+            }
+            Triangle assembled[2];
+            ntriangles[i] = assemble_triangle(screen_coords, image, cull, assembled, stats);
+            if (ntriangles[i] > 0) {
+                triangles[i] = assembled[0];
+            }
+            if (ntriangles[i] > 1) {
+                overflows[worker].emplace_back(i, assembled[1]);
+            }
+        }
+    });
+    // Slot nfaces + k holds the k-th second piece in face order
+    std::vector<std::pair<int, Triangle> > overflow;
+    for (auto &pieces: overflows) {
+        overflow.insert(overflow.end(), pieces.begin(), pieces.end());
+    }
+    std::sort(overflow.begin(), overflow.end(),
+              [](const std::pair<int, Triangle> &a, const std::pair<int, Triangle> &b) { return a.first < b.first; });
+
+    TileBins bins(image.get_width(), image.get_height());
+    std::size_t next_overflow = 0;
+    for (int i=0; i < nfaces; ++i) {
+        if (ntriangles[i] > 0) {
+            bins.insert(i, triangles[i]);
+        }
+        if (ntriangles[i] > 1) {
+            bins.insert(nfaces + static_cast<int>(next_overflow), overflow[next_overflow].second);
+            ++next_overflow;
+        }
+    }
+
+    pool.parallel_for(bins.ntiles(), [&](int tile, int worker) {
+        Shader &tile_shader = shaders[worker];
+        int current_face = -1;
+        for (int slot: bins.bin(tile)) {
+            int face = slot < nfaces ? slot : overflow[slot - nfaces].first;
+            if (face != current_face) {
+                // Run the vertex shader for this face's varyings
+                current_face = face;
+                for (int j = 0; j < 3; ++j){
+                    tile_shader.vertex(current_face, j);
+                }
+            }
+            Triangle &triangle = slot < nfaces ? triangles[slot] : overflow[slot - nfaces].second;
+            triangle.draw_texture(zbuffer, image, tile_shader, bins.tile_min(tile), bins.tile_max(tile), hiz);
+        }
+    });
+}
+
 void projection(double coeff);
 void viewport(int x, int y, int width, int height);
 void lookat(Vector3d cam_pos, Vector3d origin, Vector3d upward_vector);
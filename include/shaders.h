@@ -1,158 +1,398 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
 #include <vector>
 
 #include "geometry.h"
 #include "shaders.h"
 #include "tgaimage.h"
 #include "model.h"
+#include "depth_buffer.h"
+#include "gbuffer.h"
 
 extern Matrix g_VIEWPORT;
 extern Matrix g_PROJECTION;
 extern Matrix g_MODELVIEW;
-extern Vector3d g_LIGHT_DIRECTION;
+extern Vector3r g_LIGHT_DIRECTION;
 extern TGAImage g_SHADOWBUFFER;
 extern const int MAX_DEPTH;
 
-mat<3, 3, double> rotation_x(double theta);
-mat<3, 3, double> rotation_y(double theta);
-mat<3, 3, double> rotation_z(double theta);
+mat<3, 3, real> rotation_x(double theta);
+mat<3, 3, real> rotation_y(double theta);
+mat<3, 3, real> rotation_z(double theta);
+
+struct FragmentPacket {
+    // Up to SIZE fragments from one row, laid out as structure of
+    // arrays so a shader can interpolate and light all lanes together.
+    // Only lanes whose bit is set in mask are to be shaded; the
+    // others hold finite values that must not be used.
+    static const int SIZE = 8;
+    int mask;
+    int y;
+    int x[SIZE];
+    double depth[SIZE];
+    real bar[3][SIZE];
+    // How bar changes one pixel right and one pixel up; the same for
+    // every lane, since it only depends on the triangle
+    real bar_dx[3];
+    real bar_dy[3];
+};
+
+template <size_t Rows>
+void interpolate_packet(const mat<Rows, 3, real> &varying, const FragmentPacket &packet,
+                        real (&out)[Rows][FragmentPacket::SIZE]) {
+    // varying * barycentric for every lane, summed in the same order
+    // as the matrix product so both give the same result
+    for (size_t row = 0; row < Rows; ++row) {
+        real v0 = varying[row][0];
+        real v1 = varying[row][1];
+        real v2 = varying[row][2];
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            out[row][lane] = v2 * packet.bar[2][lane] + v1 * packet.bar[1][lane] + v0 * packet.bar[0][lane];
+        }
+    }
+}
+
+inline void interpolate_packet(const Vector3r &varying, const FragmentPacket &packet,
+                               real (&out)[FragmentPacket::SIZE]) {
+    // varying * barycentric for every lane
+    for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+        out[lane] = varying[2] * packet.bar[2][lane] + varying[1] * packet.bar[1][lane] + varying[0] * packet.bar[0][lane];
+    }
+}
+
+inline real texture_lod(const mat<2, 3, real> &varying_uv, const Vector3r &bar_dx, const Vector3r &bar_dy) {
+    // log2 of how far uv moves over one pixel, across or up whichever
+    // is further, for Model to pick mip levels with
+    real dx[2], dy[2];
+    for (int row = 0; row < 2; ++row) {
+        const Vector3r &v = varying_uv[row];
+        dx[row] = v[2] * bar_dx[2] + v[1] * bar_dx[1] + v[0] * bar_dx[0];
+        dy[row] = v[2] * bar_dy[2] + v[1] * bar_dy[1] + v[0] * bar_dy[0];
+    }
+    real footprint = std::max(dx[0]*dx[0] + dx[1]*dx[1], dy[0]*dy[0] + dy[1]*dy[1]);
+    return real(0.5) * std::log2(footprint);
+}
+
+inline real texture_lod(const mat<2, 3, real> &varying_uv, const FragmentPacket &packet) {
+    return texture_lod(varying_uv, Vector3r(packet.bar_dx[0], packet.bar_dx[1], packet.bar_dx[2]),
+                       Vector3r(packet.bar_dy[0], packet.bar_dy[1], packet.bar_dy[2]));
+}
+
+void light_packet(Model *model, const Matrixr &uniform_M, const Matrixr &uniform_MIT, const FragmentPacket &packet,
+                  const real (&uv)[2][FragmentPacket::SIZE], real uv_lod, double (&diffuse)[FragmentPacket::SIZE],
+                  double (&specular)[FragmentPacket::SIZE]);
 
 struct IShader {
+    Vector2i gl_FragCoord; // The pixel being shaded, set by the rasterizer before fragment()
+    // How the barycentric coordinates change one pixel right and one
+    // pixel up, set along with gl_FragCoord, for texture_lod
+    Vector3r gl_BarycentricDx;
+    Vector3r gl_BarycentricDy;
+    // Screen coordinates of every model vertex, see transform_vertices
+    const std::vector<Vector4r> *vertex_buffer = nullptr;
     virtual ~IShader();
-    virtual Vector4d vertex(int iface, int nthvert) = 0;
-    virtual bool fragment(Vector3d bar, TGAColor &color) = 0;
+    virtual Vector4r vertex(int iface, int nthvert) = 0;
+    virtual bool fragment(Vector3r bar, TGAColor &color) = 0;
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]);
+
+    Vector4r transform(Model *model, int iface, int nthvert) const {
+        // Looks the corner up in the vertex buffer if there is one,
+        // otherwise transforms it with the global matrices
+        if (vertex_buffer) {
+            return (*vertex_buffer)[model->vert_index(iface, nthvert)];
+        }
+        return Matrixr(g_VIEWPORT * g_PROJECTION * g_MODELVIEW) * embed<4>(model->vert(iface, nthvert));
+    }
 };
 
-struct GouraudShader : public IShader {
+template <class Shader>
+int shade_lanes(Shader &shader, const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+    // Runs fragment() on every active lane of the packet and
+    // returns the mask of lanes that were not discarded
+    int kept = 0;
+    shader.gl_BarycentricDx = Vector3r(packet.bar_dx[0], packet.bar_dx[1], packet.bar_dx[2]);
+    shader.gl_BarycentricDy = Vector3r(packet.bar_dy[0], packet.bar_dy[1], packet.bar_dy[2]);
+    for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+        if (!((packet.mask >> lane) & 1)) {
+            continue;
+        }
+        shader.gl_FragCoord = Vector2i(packet.x[lane], packet.y);
+        Vector3r bar(packet.bar[0][lane], packet.bar[1][lane], packet.bar[2][lane]);
+        if (!shader.fragment(bar, colors[lane])) {
+            kept |= 1 << lane;
+        }
+    }
+    return kept;
+}
+
+inline int IShader::fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+    // Shades the active lanes of the packet into colors and returns
+    // the mask of those not discarded. Shaders that can work on a
+    // whole packet at once override this; by default every lane
+    // goes through fragment().
+    return shade_lanes(*this, packet, colors);
+}
+
+template <class Shader>
+constexpr bool has_batched_fragments() {
+    // True if Shader overrides fragments(). The rasterizer calls
+    // fragment() lane by lane on other final shader types, resolved at
+    // compile time; through IShader it calls fragments() virtually.
+    return !std::is_same<decltype(&Shader::fragments),
+                         int (IShader::*)(const FragmentPacket&, TGAColor (&)[FragmentPacket::SIZE])>::value;
+}
+
+struct GouraudShader final : public IShader {
     Model* model;
-    Vector3d varying_intensity;
-    mat<4, 3, double> varying_tri; // Triangle screen space coordinates, written by VS and read by FS
-    mat<4, 4, double> uniform_M;
-    mat<4, 4, double> uniform_MIT;
+    Vector3r varying_intensity;
+    mat<4, 3, real> varying_tri; // Triangle screen space coordinates, written by VS and read by FS
+    mat<4, 4, real> uniform_M;
+    mat<4, 4, real> uniform_MIT;
 
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
         varying_tri.set_col(nthvert, gl_Vertex);
         varying_intensity[nthvert] = model->norm(iface, nthvert) * g_LIGHT_DIRECTION;
         return gl_Vertex;
     }
     
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
         double intensity = varying_intensity * barycentric;
         color = TGAColor(255, 255, 255) * intensity;
         return false;
     }
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+        real intensity[FragmentPacket::SIZE];
+        interpolate_packet(varying_intensity, packet, intensity);
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            colors[lane] = TGAColor(255, 255, 255) * intensity[lane];
+        }
+        return packet.mask;
+    }
 };
 
-struct TextureShader : public IShader {
+struct TextureShader final : public IShader {
     Model* model;
-    Vector3d varying_intensity;
-    mat<2, 3, double> varying_uv;
-    mat<4, 4, double> uniform_M;
-    mat<4, 4, double> uniform_MIT;
+    Vector3r varying_intensity;
+    mat<2, 3, real> varying_uv;
+    mat<4, 4, real> uniform_M;
+    mat<4, 4, real> uniform_MIT;
     
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
-        Vector2d gl_uv = model->uv(iface, nthvert);
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
+        Vector2r gl_uv = model->uv(iface, nthvert);
         varying_uv.set_col(nthvert, gl_uv);
         varying_intensity[nthvert] = model->norm(iface, nthvert) * g_LIGHT_DIRECTION;
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
         double intensity = varying_intensity * barycentric;
-        color = model->diffuse(varying_uv * barycentric) * intensity;
+        color = model->diffuse(varying_uv * barycentric, texture_lod(varying_uv, gl_BarycentricDx, gl_BarycentricDy)) * intensity;
         return false;
     }
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+        real intensity[FragmentPacket::SIZE];
+        real uv[2][FragmentPacket::SIZE];
+        interpolate_packet(varying_intensity, packet, intensity);
+        interpolate_packet(varying_uv, packet, uv);
+        real uv_lod = texture_lod(varying_uv, packet);
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            if ((packet.mask >> lane) & 1) {
+                colors[lane] = model->diffuse(Vector2r(uv[0][lane], uv[1][lane]), uv_lod) * intensity[lane];
+            }
+        }
+        return packet.mask;
+    }
 };
 
-struct PhongShader : public IShader {
+struct PhongShader final : public IShader {
     Model* model;
-    Vector3d varying_intensity;
-    mat<2, 3, double> varying_uv;
-    mat<4, 4, double> uniform_M;
-    mat<4, 4, double> uniform_MIT;
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
-        Vector2d gl_uv = model->uv(iface, nthvert);
+    Vector3r varying_intensity;
+    mat<2, 3, real> varying_uv;
+    mat<4, 4, real> uniform_M;
+    mat<4, 4, real> uniform_MIT;
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
+        Vector2r gl_uv = model->uv(iface, nthvert);
         varying_uv.set_col(nthvert, gl_uv);
         varying_intensity[nthvert] = (model->norm(iface, nthvert) * g_LIGHT_DIRECTION) * -1.0;
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
-        Vector2d uv = varying_uv * barycentric;
-        Vector3d norm_vec = proj<3>(uniform_MIT * embed<4>(model->normalmap(uv))).normalize();
-        Vector3d light_in = proj<3>(uniform_M   * embed<4>(g_LIGHT_DIRECTION)).normalize();
-        Vector3d light_refl = (light_in * (light_in * norm_vec * 2.0) - light_in).normalize();
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
+        Vector2r uv = varying_uv * barycentric;
+        real uv_lod = texture_lod(varying_uv, gl_BarycentricDx, gl_BarycentricDy);
+        Vector3r norm_vec = proj<3>(uniform_MIT * embed<4>(model->normalmap(uv, uv_lod))).normalize();
+        Vector3r light_in = proj<3>(uniform_M   * embed<4>(g_LIGHT_DIRECTION)).normalize();
+        Vector3r light_refl = (light_in * (light_in * norm_vec * 2.0) - light_in).normalize();
         
         double diffuse_intensity = std::max(0.0, (light_in * norm_vec) * -1.0);
-        double specular_intensity = pow(std::max((light_refl * g_LIGHT_DIRECTION) *-1.0, 0.0), model->specularmap(uv));
+        double specular_intensity = pow(std::max((light_refl * g_LIGHT_DIRECTION) *-1.0, 0.0), model->specularmap(uv, uv_lod));
         double intensity = 0.30 + 0.60 * diffuse_intensity + 0.10 * specular_intensity;
-        color = model->diffuse(varying_uv * barycentric) * intensity;
+        color = model->diffuse(varying_uv * barycentric, uv_lod) * intensity;
         return false;
     }
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+        real uv[2][FragmentPacket::SIZE];
+        double diffuse[FragmentPacket::SIZE];
+        double specular[FragmentPacket::SIZE];
+        interpolate_packet(varying_uv, packet, uv);
+        real uv_lod = texture_lod(varying_uv, packet);
+        light_packet(model, uniform_M, uniform_MIT, packet, uv, uv_lod, diffuse, specular);
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            if ((packet.mask >> lane) & 1) {
+                double intensity = 0.30 + 0.60 * diffuse[lane] + 0.10 * specular[lane];
+                colors[lane] = model->diffuse(Vector2r(uv[0][lane], uv[1][lane]), uv_lod) * intensity;
+            }
+        }
+        return packet.mask;
+    }
 };
 
-struct ShadowShader : public IShader {
+struct ShadowShader final : public IShader {
     Model* model;
-    Vector3d varying_intensity;
-    mat<2, 3, double> varying_uv;
-    mat<3, 3, double> varying_tri;
-    mat<4, 4, double> uniform_M;
-    mat<4, 4, double> uniform_MIT;
-    mat<4, 4, double> uniform_MShadow;
-    TGAImage shadowbuffer;
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
-        Vector2d gl_uv = model->uv(iface, nthvert);
+    Vector3r varying_intensity;
+    mat<2, 3, real> varying_uv;
+    mat<3, 3, real> varying_tri;
+    mat<4, 4, real> uniform_M;
+    mat<4, 4, real> uniform_MIT;
+    mat<4, 4, real> uniform_MShadow;
+    const DepthBuffer *shadowbuffer;
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
+        Vector2r gl_uv = model->uv(iface, nthvert);
         varying_uv.set_col(nthvert, gl_uv);
         varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
-        Vector4d shadowbuffer_point = uniform_MShadow * embed<4>(varying_tri * barycentric);
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
+        color = shade(varying_tri * barycentric, varying_uv * barycentric,
+                      texture_lod(varying_uv, gl_BarycentricDx, gl_BarycentricDy));
+        return false;
+    }
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+        real point[3][FragmentPacket::SIZE];
+        real uv[2][FragmentPacket::SIZE];
+        double diffuse[FragmentPacket::SIZE];
+        double specular[FragmentPacket::SIZE];
+        real shadowbuffer_point[4][FragmentPacket::SIZE];
+        interpolate_packet(varying_tri, packet, point);
+        interpolate_packet(varying_uv, packet, uv);
+        for (int row = 0; row < 4; ++row) {
+            const Vector4r &m = uniform_MShadow[row];
+            for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+                shadowbuffer_point[row][lane] = m[3] + m[2] * point[2][lane] + m[1] * point[1][lane] + m[0] * point[0][lane];
+            }
+        }
+        real uv_lod = texture_lod(varying_uv, packet);
+        light_packet(model, uniform_M, uniform_MIT, packet, uv, uv_lod, diffuse, specular);
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            if (!((packet.mask >> lane) & 1)) {
+                continue;
+            }
+            real w = shadowbuffer_point[3][lane];
+            double shadow_depth = shadowbuffer->get(static_cast<int>(shadowbuffer_point[0][lane] / w),
+                                                    static_cast<int>(shadowbuffer_point[1][lane] / w)) - 1.0;
+            double shadow = shadow_depth < shadowbuffer_point[2][lane] / w ? 1.0 : 0.1;
+            double intensity = 0.30 + shadow * (0.60 * diffuse[lane] + 0.10 * specular[lane]);
+            colors[lane] = model->diffuse(Vector2r(uv[0][lane], uv[1][lane]), uv_lod) * intensity;
+        }
+        return packet.mask;
+    }
+
+    TGAColor shade(Vector3r point, Vector2r uv, real uv_lod) const {
+        // Lights a surface point given its screen position, texture
+        // coordinates and texture LOD. Shared by fragment() and the
+        // deferred resolve pass.
+        Vector4r shadowbuffer_point = uniform_MShadow * embed<4>(point);
         shadowbuffer_point = shadowbuffer_point / shadowbuffer_point[3];
         double shadow;
-        int shadow_depth = shadowbuffer.get(static_cast<int>(shadowbuffer_point[0]), static_cast<int>(shadowbuffer_point[1])).bgra[0] - 1;
+        double shadow_depth = shadowbuffer->get(static_cast<int>(shadowbuffer_point[0]), static_cast<int>(shadowbuffer_point[1])) - 1.0;
         if (shadow_depth < shadowbuffer_point[2]) {
             shadow = 1.0;
         } else {
             shadow = 0.1;
         }
-        Vector2d uv = varying_uv * barycentric;
-        Vector3d norm_vec = proj<3>(uniform_MIT * embed<4>(model->normalmap(uv))).normalize();
-        Vector3d light_in = proj<3>(uniform_M   * embed<4>(g_LIGHT_DIRECTION)).normalize();
-        Vector3d light_refl = (light_in * (light_in * norm_vec * 2.0) - light_in).normalize();
+        Vector3r norm_vec = proj<3>(uniform_MIT * embed<4>(model->normalmap(uv, uv_lod))).normalize();
+        Vector3r light_in = proj<3>(uniform_M   * embed<4>(g_LIGHT_DIRECTION)).normalize();
+        Vector3r light_refl = (light_in * (light_in * norm_vec * 2.0) - light_in).normalize();
         
         double diffuse_intensity = std::max(0.0, (light_in * norm_vec) * -1.0);
-        double specular_intensity = pow(std::max((light_refl * g_LIGHT_DIRECTION) *-1.0, 0.0), model->specularmap(uv));
+        double specular_intensity = pow(std::max((light_refl * g_LIGHT_DIRECTION) *-1.0, 0.0), model->specularmap(uv, uv_lod));
         double intensity = 0.30 + shadow * (0.60 * diffuse_intensity + 0.10 * specular_intensity);
-        color = model->diffuse(varying_uv * barycentric) * intensity;
+        return model->diffuse(uv, uv_lod) * intensity;
+    }
+};
+
+struct GBufferShader final : public IShader {
+    // The geometry pass of deferred shading: instead of lighting,
+    // records what ShadowShader::shade needs into the G-buffer.
+    Model* model;
+    int model_id;
+    GBuffer *gbuffer;
+    mat<2, 3, real> varying_uv;
+    mat<3, 3, real> varying_tri;
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
+        Vector2r gl_uv = model->uv(iface, nthvert);
+        varying_uv.set_col(nthvert, gl_uv);
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
+        return gl_Vertex;
+    }
+
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
+        gbuffer->set(gl_FragCoord.x, gl_FragCoord.y, model_id, varying_uv * barycentric,
+                     texture_lod(varying_uv, gl_BarycentricDx, gl_BarycentricDy), varying_tri * barycentric);
+        color = TGAColor(0, 0, 0);
         return false;
     }
+
+    virtual int fragments(const FragmentPacket &packet, TGAColor (&colors)[FragmentPacket::SIZE]) {
+        // Records the texture LOD ShadowShader::fragments() would use
+        real point[3][FragmentPacket::SIZE];
+        real uv[2][FragmentPacket::SIZE];
+        interpolate_packet(varying_tri, packet, point);
+        interpolate_packet(varying_uv, packet, uv);
+        real uv_lod = texture_lod(varying_uv, packet);
+        for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+            if ((packet.mask >> lane) & 1) {
+                gbuffer->set(packet.x[lane], packet.y, model_id, Vector2r(uv[0][lane], uv[1][lane]), uv_lod,
+                             Vector3r(point[0][lane], point[1][lane], point[2][lane]));
+            }
+            colors[lane] = TGAColor(0, 0, 0);
+        }
+        return packet.mask;
+    }
 };
 
-struct SSAOShader : public IShader {
+struct SSAOShader final : public IShader {
     Model* model;
-    mat<2, 3, double> varying_uv;
-    mat<4, 4, double> uniform_MIT;
-    mat<3, 3, double> varying_tri;
-    TGAImage zbuffer;
-    std::vector<Vector3d> kernel;
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
-        Vector2d gl_uv = model->uv(iface, nthvert);
+    mat<2, 3, real> varying_uv;
+    mat<4, 4, real> uniform_MIT;
+    mat<3, 3, real> varying_tri;
+    const DepthBuffer *zbuffer;
+    std::vector<Vector3r> kernel;
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
+        Vector2r gl_uv = model->uv(iface, nthvert);
         varying_uv.set_col(nthvert, gl_uv);
         varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
         auto uv = varying_uv * barycentric;
-        Vector3d norm_vec = model->normalmap(uv).normalize();
+        Vector3r norm_vec = model->normalmap(uv).normalize();
         // Since the normal vector is ... normalised,
         // we know r = 1.0; We can then calculate
         // theta and phi to rotate our sample vector 
@@ -170,8 +410,8 @@ struct SSAOShader : public IShader {
             //std::cout << "POINT:        " << (point).x << ", " << (point).y << ", " << (point).z << "\n";
             //std::cout << "POINT + NORM: " << (point + norm_vec).x << ", " <<(point + norm_vec).y << ", " <<  (point + norm_vec).z << "\n";
             //std::cout << "POINT + SAMP: " << (point + vec).x << ", " << (point + vec).y << ", " << (point +vec).z << "\n";
-            //std::cout << point.z << " vs " << static_cast<int>(zbuffer.get(point.x, point.y).bgra[0]) << "\n";
-            if (zbuffer.get(point.x, point.y).bgra[0] > point.z) {
+            //std::cout << point.z << " vs " << zbuffer->get(point.x, point.y) << "\n";
+            if (zbuffer->get(static_cast<int>(point.x), static_cast<int>(point.y)) > point.z) {
                 occluded += 1;  
             }
         }
@@ -181,38 +421,38 @@ struct SSAOShader : public IShader {
     }
 };
 
-struct DepthShader : public IShader {
+struct DepthShader final : public IShader {
     Model* model;
-    mat<3, 3, double> varying_tri;
+    mat<3, 3, real> varying_tri;
     
     DepthShader() : varying_tri() {}
     
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
         varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
-        Vector3d point = varying_tri * barycentric;
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
+        Vector3r point = varying_tri * barycentric;
         color = TGAColor(255, 255, 255) * (point.z / MAX_DEPTH);
         return false;
     }
 };
 
-struct EmptyShader : public IShader {
+struct EmptyShader final : public IShader {
     Model* model;
-    mat<3, 3, double> varying_tri;
+    mat<3, 3, real> varying_tri;
     
     EmptyShader() : varying_tri() {}
     
-    virtual Vector4d vertex(int iface, int nthvert) {
-        Vector4d gl_Vertex = g_VIEWPORT * g_PROJECTION * g_MODELVIEW * embed<4>(model->vert(iface, nthvert));
+    virtual Vector4r vertex(int iface, int nthvert) {
+        Vector4r gl_Vertex = transform(model, iface, nthvert);
         varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
         return gl_Vertex;
     }
         
-    virtual bool fragment(Vector3d barycentric, TGAColor &color) {
+    virtual bool fragment(Vector3r barycentric, TGAColor &color) {
         color = TGAColor(0, 0, 0);
         return false;
     }
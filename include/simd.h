@@ -0,0 +1,85 @@
+#pragma once
+
+// A block of BLOCK_WIDTH doubles that the rasterizer evaluates
+// together: one lane per pixel along a span. The instruction set
+// behind it is chosen at build time through TINYRENDERER_SIMD in
+// CMakeLists.txt; with neither AVX nor SSE, TINYRENDERER_SIMD is
+// left undefined and the rasterizer uses its scalar loop.
+
+#if defined(TINYRENDERER_SIMD_AVX)
+#include <immintrin.h>
+#define TINYRENDERER_SIMD
+typedef __m256d simd_reg;
+const int SIMD_REG_WIDTH = 4;
+inline simd_reg simd_set1(double v)                 { return _mm256_set1_pd(v); }
+inline simd_reg simd_load(const double *p)          { return _mm256_loadu_pd(p); }
+inline simd_reg simd_load(const float *p)           { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+inline void     simd_store(double *p, simd_reg a)   { _mm256_storeu_pd(p, a); }
+inline void     simd_store(float *p, simd_reg a)    { _mm_storeu_ps(p, _mm256_cvtpd_ps(a)); }
+inline simd_reg simd_add(simd_reg a, simd_reg b)    { return _mm256_add_pd(a, b); }
+inline simd_reg simd_mul(simd_reg a, simd_reg b)    { return _mm256_mul_pd(a, b); }
+inline int      simd_ge_mask(simd_reg a, simd_reg b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ)); }
+#elif defined(TINYRENDERER_SIMD_SSE)
+#include <emmintrin.h>
+#define TINYRENDERER_SIMD
+typedef __m128d simd_reg;
+const int SIMD_REG_WIDTH = 2;
+inline simd_reg simd_set1(double v)                 { return _mm_set1_pd(v); }
+inline simd_reg simd_load(const double *p)          { return _mm_loadu_pd(p); }
+inline simd_reg simd_load(const float *p)           { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))); }
+inline void     simd_store(double *p, simd_reg a)   { _mm_storeu_pd(p, a); }
+inline void     simd_store(float *p, simd_reg a)    { _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_castps_si128(_mm_cvtpd_ps(a))); }
+inline simd_reg simd_add(simd_reg a, simd_reg b)    { return _mm_add_pd(a, b); }
+inline simd_reg simd_mul(simd_reg a, simd_reg b)    { return _mm_mul_pd(a, b); }
+inline int      simd_ge_mask(simd_reg a, simd_reg b) { return _mm_movemask_pd(_mm_cmpge_pd(a, b)); }
+#endif
+
+#ifdef TINYRENDERER_SIMD
+
+const int BLOCK_WIDTH = 8;
+
+struct PixelBlock {
+    static const int NREGS = BLOCK_WIDTH / SIMD_REG_WIDTH;
+    simd_reg regs[NREGS];
+
+    static PixelBlock broadcast(double v) {
+        PixelBlock ret;
+        for (int i=NREGS; i--; ret.regs[i] = simd_set1(v));
+        return ret;
+    }
+
+    template <typename T>
+    static PixelBlock load(const T *p) {
+        // Loads BLOCK_WIDTH doubles, or floats widened to double
+        PixelBlock ret;
+        for (int i=NREGS; i--; ret.regs[i] = simd_load(p + i * SIMD_REG_WIDTH));
+        return ret;
+    }
+
+    template <typename T>
+    void store(T *p) const {
+        // Stores BLOCK_WIDTH doubles, or narrows them to float
+        for (int i=NREGS; i--; simd_store(p + i * SIMD_REG_WIDTH, regs[i]));
+    }
+};
+
+inline PixelBlock operator+(PixelBlock lhs, const PixelBlock& rhs) {
+    for (int i=PixelBlock::NREGS; i--; lhs.regs[i] = simd_add(lhs.regs[i], rhs.regs[i]));
+    return lhs;
+}
+
+inline PixelBlock operator*(PixelBlock lhs, const PixelBlock& rhs) {
+    for (int i=PixelBlock::NREGS; i--; lhs.regs[i] = simd_mul(lhs.regs[i], rhs.regs[i]));
+    return lhs;
+}
+
+inline int greater_equal_mask(const PixelBlock& lhs, const PixelBlock& rhs) {
+    // Bit i is set where lane i of lhs >= lane i of rhs
+    int mask = 0;
+    for (int i=PixelBlock::NREGS; i--; ) {
+        mask |= simd_ge_mask(lhs.regs[i], rhs.regs[i]) << (i * SIMD_REG_WIDTH);
+    }
+    return mask;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// uv_lod for a sample with no footprint, which always reads level 0
+const real MAGNIFIED = -std::numeric_limits<real>::infinity();
+
+class Texture {
+    // A texture and its mip pyramid, each level half the size of the
+    // one before down to 1x1, box filtered from it at load time.
+    // Samples are bilinear, and trilinear between the two levels
+    // around the level of detail when the pixel footprint covers more
+    // than one texel. Coordinates are clamped to the edge; an empty
+    // texture samples black, like TGAImage::get out of range.
+    // A LINEAR texture of a mapped TGAImage reads level 0 in place from
+    // the mapping, so textures of one file share its pages.
+    public:
+        enum Layout {
+            // LINEAR stores each level row-major like TGAImage. TILED
+            // stores it as TILE x TILE blocks, row-major inside a block
+            // and between blocks, so texels close in both x and y share
+            // cache lines and a footprint running up the texture touches
+            // far fewer of them. Levels are padded to whole tiles.
+            // Whether that pays depends on the access pattern, so
+            // TILED is only used when asked for.
+            LINEAR, TILED
+        };
+        static const int TILE = 4;
+    private:
+        struct Level {
+            int width;
+            int height;
+            int tiles_x;
+            std::vector<unsigned char> texels;
+            // Texels apart from one row to the next in a LINEAR level
+            int stride;
+            // Set when a LINEAR level 0 reads a mapped image in place
+            const unsigned char *borrowed;
+            const unsigned char *pixels() const { return borrowed ? borrowed : texels.data(); }
+        };
+        std::vector<Level> levels;
+        // Keeps a borrowed level 0 mapped
+        std::shared_ptr<const MappedFile> mapping;
+        int bytespp;
+        Layout layout;
+        real log2_size;
+
+        template <Layout L>
+        static int texel_index(const Level &level, int x, int y) {
+            if (L == LINEAR) {
+                return x + y*level.stride;
+            }
+            // x and y are never negative, so unsigned lets / and % be shifts and masks
+            unsigned tx = x, ty = y;
+            return ((ty / TILE) * level.tiles_x + tx / TILE) * TILE * TILE + (ty % TILE) * TILE + tx % TILE;
+        }
+        template <Layout L, int Channels>
+        void bilinear(const Level &level, Vector2r uv, int (&out)[4]) const;
+        template <Layout L, int Channels>
+        void filter(Vector2r uv, real uv_lod, int (&out)[4]) const;
+        template <Layout L>
+        void filter(Vector2r uv, real uv_lod, int (&out)[4]) const;
+    public:
+        Texture();
+        explicit Texture(TGAImage &image, Layout layout=LINEAR);
+        int get_width() const { return levels.empty() ? 0 : levels[0].width; }
+        int get_height() const { return levels.empty() ? 0 : levels[0].height; }
+        int nlevels() const { return static_cast<int>(levels.size()); }
+        Layout get_layout() const { return layout; }
+        // Bytes of texels in all levels
+        std::size_t memory_size() const;
+
+        // The texel at (x, y) of a level, unfiltered and unchecked
+        TGAColor get(int x, int y, int level=0) const;
+        // uv_lod is log2 of the size of one pixel in uv units, as
+        // given by texture_lod in shaders.h; the texture adds its own
+        // size to pick the level
+        TGAColor sample(Vector2r uv, real uv_lod=MAGNIFIED) const;
+};
@@ -2,6 +2,10 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <memory>
+#include <vector>
+
+class MappedFile;
 
 #pragma pack(push,1)
 struct TGA_Header {
@@ -86,9 +90,15 @@ protected:
     int width{0};
     int height{0};
     int bytespp{0};
-
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    // Set instead of data for an image from map_tga_file, whose row y
+    // is read in place at pixels + y*row_stride; anything that writes
+    // to the image first copies it into data
+    std::shared_ptr<const MappedFile> mapping;
+    const unsigned char *pixels{nullptr};
+    long row_stride{0};
+    void make_writable();
+
+    bool   load_rle_data(const unsigned char *in, const unsigned char *end, bool flip);
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
@@ -97,8 +107,32 @@ public:
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
-    bool read_tga_file(const char *filename);
-    bool write_tga_file(const char *filename, bool rle=true);
+    TGAImage(TGAImage &&img) noexcept;
+    // Rows are stored top to bottom, or bottom to top with bottom_up as
+    // texture coordinates expect; either way the rows are put in place
+    // as they are decoded
+    bool read_tga_file(const char *filename, bool bottom_up=false);
+    // Like read_tga_file, but an uncompressed file is mapped read-only
+    // rather than copied, so every image of it shares the page cache.
+    // Other files are decoded as usual.
+    bool map_tga_file(const char *filename, bool bottom_up=false);
+    bool is_mapped() const { return mapping != nullptr; }
+    // The mapping a mapped image reads from, for holders of its rows
+    std::shared_ptr<const MappedFile> get_mapping() const { return mapping; }
+    // Row y, and how many bytes apart rows are, negative if the rows
+    // run backwards through memory
+    const unsigned char *row(int y) const;
+    long get_row_stride() const { return mapping ? row_stride : static_cast<long>(width)*bytespp; }
+    // With bottom_up, the header marks the first row in memory as the
+    // bottom one, which saves flipping the image to store it that way
+    bool write_tga_file(const char *filename, bool rle=true, bool bottom_up=false);
+    // Appends rows [first, last) as they go in a TGA file, RLE packets
+    // never crossing a row, so ranges can be encoded independently
+    void encode_rows(int first, int last, bool rle, std::vector<unsigned char> &out) const;
+    // Writes a TGA file of this image's header and encode_rows output
+    // for all rows, given as consecutive parts
+    bool write_encoded(const char *filename, bool rle, bool bottom_up,
+                       const std::vector<std::vector<unsigned char>> &parts) const;
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
@@ -108,9 +142,10 @@ public:
     bool set(int x, int y, const TGAColor &c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
-    int get_width();
-    int get_height();
-    int get_bytespp();
+    TGAImage & operator =(TGAImage &&img) noexcept;
+    int get_width() const;
+    int get_height() const;
+    int get_bytespp() const;
     unsigned char *buffer();
     void clear();
     void gaussian_blur(const int radius);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    // A fixed set of worker threads that run parallel_for jobs.
+    // The calling thread takes part in the work as worker 0,
+    // so a pool of size 1 runs everything inline. So does a
+    // parallel_for issued while another one is running, from a task
+    // or from another thread, rather than waiting for the workers.
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable job_ready;
+        std::condition_variable job_done;
+        std::function<void(int, int)> job;
+        std::atomic<int> next_task{0};
+        int task_count{0};
+        int busy_workers{0};
+        unsigned long generation{0};
+        bool stopping{false};
+        std::atomic<bool> dispatching{false};
+        void worker_loop(int worker);
+        void run_tasks(int worker);
+    public:
+        explicit ThreadPool(int nthreads=0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool & operator =(const ThreadPool&) = delete;
+        int size() const;
+        void parallel_for(int count, std::function<void(int task, int worker)> fn);
+};
+
+ThreadPool& render_pool();
@@ -0,0 +1,105 @@
+#include <chrono>
+#include <filesystem>
+#include "asset_cache.h"
+
+AssetCache::AssetCache(std::size_t budget) : budget(budget) {
+}
+
+void AssetCache::set_budget(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    evict();
+}
+
+AssetCache::Stats AssetCache::get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+std::shared_ptr<const void> AssetCache::get_any(const std::string &kind, const char *filename,
+                                                const std::function<Loaded(const std::string &path)> &load) {
+    std::error_code error;
+    std::filesystem::path path = std::filesystem::canonical(filename, error);
+    long long mtime = 0;
+    if (!error) {
+        mtime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+    }
+    if (error) {
+        // Let the loader report the missing file
+        return load(filename).first;
+    }
+
+    std::string key = kind + '\n' + path.string();
+    std::promise<std::shared_ptr<const void>> promise;
+    std::shared_future<std::shared_ptr<const void>> asset;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find(key);
+        if (found != entries.end() && found->second.mtime == mtime) {
+            ++stats.hits;
+            recency.splice(recency.begin(), recency, found->second.recent);
+            asset = found->second.asset;
+        } else {
+            if (found != entries.end()) {
+                // The file changed since it was loaded. Models holding
+                // the old asset keep it until they let go.
+                stats.bytes -= found->second.bytes;
+                recency.erase(found->second.recent);
+                entries.erase(found);
+            }
+            ++stats.misses;
+            recency.push_front(key);
+            entries[key] = Entry{promise.get_future().share(), mtime, 0, recency.begin()};
+        }
+    }
+    if (asset.valid()) {
+        return asset.get();
+    }
+
+    Loaded loaded;
+    try {
+        loaded = load(path.string());
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find(key);
+        if (found != entries.end() && found->second.mtime == mtime && found->second.bytes == 0) {
+            recency.erase(found->second.recent);
+            entries.erase(found);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    promise.set_value(loaded.first);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = entries.find(key);
+    if (found != entries.end() && found->second.mtime == mtime) {
+        found->second.bytes = loaded.second;
+        stats.bytes += loaded.second;
+        evict();
+    }
+    return loaded.first;
+}
+
+void AssetCache::evict() {
+    // Called with the mutex held. Assets still loading or held by a
+    // caller are skipped: dropping them would free nothing.
+    auto recent = recency.end();
+    while (stats.bytes > budget && recent != recency.begin()) {
+        --recent;
+        auto found = entries.find(*recent);
+        const Entry &entry = found->second;
+        if (entry.asset.wait_for(std::chrono::seconds(0)) != std::future_status::ready
+            || entry.asset.get().use_count() > 1) {
+            continue;
+        }
+        stats.bytes -= entry.bytes;
+        ++stats.evictions;
+        entries.erase(found);
+        recent = recency.erase(recent);
+    }
+}
+
+AssetCache& asset_cache() {
+    static AssetCache cache;
+    return cache;
+}
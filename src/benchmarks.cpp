@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+#include "benchmarks.h"
+#include "gbuffer.h"
+#include "our_gl.h"
+#include "shaders.h"
+#include "texture.h"
+#include "tgaimage.h"
+
+const double PI = std::atan(1.0)*4;
+
+template <class Shader>
+static void benchmark_shader(const char *name, Shader &shader, int nfaces) {
+    // Draws the faces serially with the concrete shader type and
+    // through IShader, and prints the best of a few times of each.
+    // Both run the same fragments(): the templated draw calls it
+    // directly, or fragment() lane by lane for a shader without one,
+    // and the IShader draw reaches the same code through the vtable.
+    // So only the dispatch differs, which the images being equal
+    // confirms. The runs alternate after a warm-up draw, so neither
+    // pays for cold caches.
+    const int repeats = 5;
+    auto time_draw = [&](auto &draw_shader, TGAImage &image) {
+        DepthBuffer zbuffer(SCREEN_X, SCREEN_Y);
+        image = TGAImage(SCREEN_X, SCREEN_Y, TGAImage::RGB);
+        auto start_time = std::chrono::high_resolution_clock::now();
+        draw_faces(draw_shader, nfaces, zbuffer, image);
+        auto end_time = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count() * 1000;
+    };
+    IShader &virtual_shader = shader;
+    TGAImage templated_image, virtual_image;
+    time_draw(shader, templated_image);
+    double templated_time = std::numeric_limits<double>::infinity();
+    double virtual_time = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < repeats; ++i) {
+        templated_time = std::min(templated_time, time_draw(shader, templated_image));
+        virtual_time = std::min(virtual_time, time_draw(virtual_shader, virtual_image));
+    }
+    bool same = true;
+    for (int y = 0; y < SCREEN_Y; ++y) {
+        same = same && std::memcmp(templated_image.row(y), virtual_image.row(y), SCREEN_X * TGAImage::RGB) == 0;
+    }
+    std::cout << name << ": templated " << templated_time << "ms, virtual " << virtual_time << "ms"
+              << (same ? "" : " (images differ)") << "\n";
+}
+
+void benchmark_shaders(Model *model, const DepthBuffer &shadow_depth, const Matrix &MShadow,
+                       Vector3d camera, Vector3d origin, Vector3d upwards) {
+    lookat(camera, origin, upwards);
+    viewport(0, 0, SCREEN_X, SCREEN_Y);
+    projection(-1.0/(camera - origin).norm());
+    std::vector<Vector4r> vertex_buffer = transform_vertices(*model, g_VIEWPORT * g_PROJECTION * g_MODELVIEW);
+    Matrix uniform_M = g_PROJECTION * g_MODELVIEW;
+    Matrix uniform_MIT = uniform_M.invert_transpose();
+    int nfaces = model->nfaces();
+
+    GouraudShader gouraud;
+    gouraud.model = model;
+    gouraud.vertex_buffer = &vertex_buffer;
+    benchmark_shader("GouraudShader", gouraud, nfaces);
+
+    TextureShader texture;
+    texture.model = model;
+    texture.vertex_buffer = &vertex_buffer;
+    benchmark_shader("TextureShader", texture, nfaces);
+
+    PhongShader phong;
+    phong.model = model;
+    phong.vertex_buffer = &vertex_buffer;
+    phong.uniform_M = uniform_M;
+    phong.uniform_MIT = uniform_MIT;
+    benchmark_shader("PhongShader", phong, nfaces);
+
+    ShadowShader shadow;
+    shadow.model = model;
+    shadow.vertex_buffer = &vertex_buffer;
+    shadow.uniform_M = uniform_M;
+    shadow.uniform_MIT = uniform_MIT;
+    shadow.uniform_MShadow = MShadow * (g_VIEWPORT * g_PROJECTION * g_MODELVIEW).invert();
+    shadow.shadowbuffer = &shadow_depth;
+    benchmark_shader("ShadowShader", shadow, nfaces);
+
+    GBuffer gbuffer(SCREEN_X, SCREEN_Y);
+    GBufferShader geometry;
+    geometry.model = model;
+    geometry.model_id = 0;
+    geometry.gbuffer = &gbuffer;
+    geometry.vertex_buffer = &vertex_buffer;
+    benchmark_shader("GBufferShader", geometry, nfaces);
+
+    SSAOShader ssao;
+    ssao.model = model;
+    ssao.vertex_buffer = &vertex_buffer;
+    ssao.uniform_MIT = uniform_MIT;
+    ssao.zbuffer = &shadow_depth;
+    benchmark_shader("SSAOShader", ssao, nfaces);
+
+    DepthShader depth;
+    depth.model = model;
+    depth.vertex_buffer = &vertex_buffer;
+    benchmark_shader("DepthShader", depth, nfaces);
+
+    EmptyShader empty;
+    empty.model = model;
+    empty.vertex_buffer = &vertex_buffer;
+    benchmark_shader("EmptyShader", empty, nfaces);
+}
+
+template <class Invert>
+static double time_inverse(const std::vector<Matrix> &matrices, Invert invert, double &checksum) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (const Matrix &m : matrices) {
+        checksum += invert(m)[0][0];
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count() * 1000;
+}
+
+void benchmark_inverse() {
+    // The same random matrices through both paths
+    const int count = 200000;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+    std::vector<Matrix> general(count), affine(count);
+    for (int n = 0; n < count; n++) {
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                general[n][i][j] = affine[n][i][j] = distribution(rng);
+            }
+        }
+        for (int j = 0; j < 4; j++) {
+            affine[n][3][j] = j == 3 ? 1.0 : 0.0;
+        }
+    }
+    auto adjugate = [](const Matrix &m) {
+        Matrix adjugate = m.adjugate();
+        return adjugate / (adjugate[0]*m[0]);
+    };
+    auto closed_form = [](const Matrix &m) { return m.invert_transpose(); };
+    double checksum = 0;
+    double general_adjugate = time_inverse(general, adjugate, checksum);
+    double general_closed = time_inverse(general, closed_form, checksum);
+    double affine_adjugate = time_inverse(affine, adjugate, checksum);
+    double affine_closed = time_inverse(affine, closed_form, checksum);
+    std::cout << "Inverse of " << count << " general matrices: adjugate " << general_adjugate
+              << "ms, closed form " << general_closed << "ms\n";
+    std::cout << "Inverse of " << count << " affine matrices: adjugate " << affine_adjugate
+              << "ms, closed form " << affine_closed << "ms (checksum " << checksum << ")\n";
+}
+
+template <class Fetch>
+static double time_fetches(Fetch fetch, int &checksum) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    checksum += fetch();
+    auto end_time = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count() * 1000;
+}
+
+void benchmark_textures(const char *filename) {
+    TGAImage image;
+    if (!image.read_tga_file(filename)) {
+        return;
+    }
+    Texture textures[2] = {Texture(image, Texture::LINEAR), Texture(image, Texture::TILED)};
+    const char *names[2] = {"linear", "tiled"};
+    int width = textures[0].get_width();
+    int height = textures[0].get_height();
+    const int lines = 4000;
+    const int steps = 256;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    std::vector<Vector2r> starts(lines), directions(lines);
+    for (int i = 0; i < lines; i++) {
+        double angle = distribution(rng) * 2 * PI;
+        starts[i] = Vector2r(distribution(rng), distribution(rng));
+        directions[i] = Vector2r(std::cos(angle) / width, std::sin(angle) / height);
+    }
+    int checksum = 0;
+    for (int t = 0; t < 2; t++) {
+        const Texture &texture = textures[t];
+        double columns_time = time_fetches([&]() {
+            int sum = 0;
+            for (int x = 0; x < width; x++) {
+                for (int y = 0; y < height; y++) {
+                    sum += texture.get(x, y).bgra[0];
+                }
+            }
+            return sum;
+        }, checksum);
+        double lines_time = time_fetches([&]() {
+            int sum = 0;
+            for (int i = 0; i < lines; i++) {
+                for (int step = 0; step < steps; step++) {
+                    sum += texture.sample(starts[i] + directions[i] * step).bgra[0];
+                }
+            }
+            return sum;
+        }, checksum);
+        std::cout << filename << " " << names[t] << ": " << width * height / columns_time / 1000
+                  << " M texels/s by column, " << lines * steps / lines_time / 1000
+                  << " M bilinear samples/s along lines\n";
+    }
+    std::cout << "(checksum " << checksum << ")\n";
+}
+
+void benchmark_tga_decode(const char *filename) {
+    const int repeats = 50;
+    TGAImage image;
+    if (!image.read_tga_file(filename)) {
+        return;
+    }
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    double file_mb = static_cast<double>(file.tellg()) / (1 << 20);
+    double image_mb = static_cast<double>(image.get_width()) * image.get_height() * image.get_bytespp() / (1 << 20);
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < repeats; i++) {
+        image.read_tga_file(filename);
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count() / repeats;
+    std::cout << filename << ": " << seconds * 1000 << "ms per decode, " << file_mb / seconds << " MB/s read, "
+              << image_mb / seconds << " MB/s decoded\n";
+}
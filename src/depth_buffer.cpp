@@ -0,0 +1,22 @@
+#include <algorithm>
+#include "depth_buffer.h"
+#include "tgaimage.h"
+
+DepthBuffer::DepthBuffer(int w, int h, float clear_value) : width(w), height(h), data(w*h, clear_value) {
+}
+
+void DepthBuffer::clear(float value) {
+    std::fill(data.begin(), data.end(), value);
+}
+
+TGAImage DepthBuffer::to_image(double max_depth) const {
+    // Converts to a GRAYSCALE image for dumping, with depths
+    // [0, max_depth] mapped onto [0, 255].
+    TGAImage image(width, height, TGAImage::GRAYSCALE);
+    unsigned char *pixels = image.buffer();
+    for (int i = 0; i < width*height; ++i) {
+        double scaled = data[i] * 255.0 / max_depth;
+        pixels[i] = static_cast<unsigned char>(std::min(255.0, std::max(0.0, scaled)));
+    }
+    return image;
+}
@@ -0,0 +1,109 @@
+#include <cstring>
+#include <iostream>
+#include "frame_sink.h"
+
+FrameSink::FrameSink(const char *path, Format format, int fps) : format(format), fps(fps) {
+    if (std::strcmp(path, "-") == 0) {
+        // stdout may have been written to already, so its buffer stays
+        // as it is; frames go out whole anyway
+        out = stdout;
+        return;
+    }
+    out = std::fopen(path, "wb");
+    if (!out) {
+        std::cerr << "can't open frame stream " << path << "\n";
+        return;
+    }
+    owns_out = true;
+    // Only gathers up small frames. The stream is closed before the
+    // buffer goes.
+    out_buffer.resize(1 << 20);
+    std::setvbuf(out, out_buffer.data(), _IOFBF, out_buffer.size());
+}
+
+FrameSink::~FrameSink() {
+    if (!out) {
+        return;
+    }
+    if (owns_out) {
+        std::fclose(out);
+    } else {
+        std::fflush(out);
+    }
+}
+
+bool FrameSink::write(const TGAImage &image, bool bottom_up) {
+    if (!out) {
+        return false;
+    }
+    if (width == 0) {
+        width = image.get_width();
+        height = image.get_height();
+        if (format == Y4M) {
+            std::fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+        }
+    } else if (image.get_width() != width || image.get_height() != height) {
+        std::cerr << "frame of " << image.get_width() << "x" << image.get_height()
+                  << " in a " << width << "x" << height << " stream\n";
+        return false;
+    }
+    convert(image, bottom_up);
+    if (std::fwrite(frame.data(), 1, frame.size(), out) != frame.size()) {
+        std::cerr << "can't write to the frame stream\n";
+        return false;
+    }
+    return true;
+}
+
+bool FrameSink::flush() {
+    return out && std::fflush(out) == 0;
+}
+
+void FrameSink::convert(const TGAImage &image, bool bottom_up) {
+    // Lays out the whole frame, header included, in frame
+    std::size_t npixels = static_cast<std::size_t>(width) * height;
+    std::size_t header = 0;
+    if (format == PPM) {
+        char text[32];
+        header = std::snprintf(text, sizeof(text), "P6\n%d %d\n255\n", width, height);
+        frame.resize(header + npixels*3);
+        std::memcpy(frame.data(), text, header);
+    } else if (format == Y4M) {
+        header = 6;
+        frame.resize(header + npixels*3);
+        std::memcpy(frame.data(), "FRAME\n", header);
+    } else {
+        frame.resize(npixels*3);
+    }
+
+    int bytespp = image.get_bytespp();
+    unsigned char *pixel = frame.data() + header;
+    // Y4M keeps its planes apart
+    unsigned char *u_plane = pixel + npixels;
+    unsigned char *v_plane = u_plane + npixels;
+    for (int r = 0; r < height; r++) {
+        const unsigned char *p = image.row(bottom_up ? height - 1 - r : r);
+        for (int x = 0; x < width; x++, p += bytespp) {
+            int b = p[0];
+            int g = bytespp == TGAImage::GRAYSCALE ? b : p[1];
+            int red = bytespp == TGAImage::GRAYSCALE ? b : p[2];
+            switch (format) {
+                case RAW_BGR:
+                    pixel[0] = b; pixel[1] = g; pixel[2] = red;
+                    pixel += 3;
+                    break;
+                case RAW_RGB:
+                case PPM:
+                    pixel[0] = red; pixel[1] = g; pixel[2] = b;
+                    pixel += 3;
+                    break;
+                case Y4M:
+                    // Offset so the chroma sums are never negative
+                    *pixel++ = ((66*red + 129*g + 25*b + 128) >> 8) + 16;
+                    *u_plane++ = (-38*red - 74*g + 112*b + 128 + (128 << 8)) >> 8;
+                    *v_plane++ = (112*red - 94*g - 18*b + 128 + (128 << 8)) >> 8;
+                    break;
+            }
+        }
+    }
+}
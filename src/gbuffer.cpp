@@ -0,0 +1,9 @@
+#include <algorithm>
+#include "gbuffer.h"
+
+GBuffer::GBuffer(int w, int h) : width(w), height(h), model_ids(w*h, EMPTY), uvs(w*h), uv_lods(w*h), points(w*h) {
+}
+
+void GBuffer::clear() {
+    std::fill(model_ids.begin(), model_ids.end(), EMPTY);
+}
@@ -4,4 +4,9 @@
 template <> template <> vec<3,int>  ::vec(const vec<3,double> &v) : x(std::lround(v.x)),y(std::lround(v.y)),z(std::lround(v.z)) {}
 template <> template <> vec<3,double>::vec(const vec<3,int> &v)   : x(v.x),y(v.y),z(v.z) {}
 template <> template <> vec<2,int>  ::vec(const vec<2,double> &v) : x(std::lround(v.x)),y(std::lround(v.y)) {}
-template <> template <> vec<2,double>::vec(const vec<2,int> &v)   : x(v.x),y(v.y) {}
\ No newline at end of file
+template <> template <> vec<2,double>::vec(const vec<2,int> &v)   : x(v.x),y(v.y) {}
+template <> template <> vec<3,float> ::vec(const vec<3,double> &v) : x(static_cast<float>(v.x)),y(static_cast<float>(v.y)),z(static_cast<float>(v.z)) {}
+template <> template <> vec<3,double>::vec(const vec<3,float> &v)  : x(v.x),y(v.y),z(v.z) {}
+template <> template <> vec<2,float> ::vec(const vec<2,double> &v) : x(static_cast<float>(v.x)),y(static_cast<float>(v.y)) {}
+template <> template <> vec<2,double>::vec(const vec<2,float> &v)  : x(v.x),y(v.y) {}
+template <> template <> vec<3,float> ::vec(const vec<3,int> &v)    : x(v.x),y(v.y),z(v.z) {}
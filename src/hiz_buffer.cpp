@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "hiz_buffer.h"
+#include "depth_buffer.h"
+
+HiZBuffer::HiZBuffer(const DepthBuffer &zbuffer) : zbuffer(&zbuffer),
+                                          blocks_x((zbuffer.get_width() + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE),
+                                          blocks_y((zbuffer.get_height() + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE),
+                                          block_farthest(blocks_x * blocks_y, 0.0),
+                                          block_nearest(blocks_x * blocks_y, 0.0),
+                                          dirty(blocks_x * blocks_y, 0) {
+    for (int block = 0; block < blocks_x * blocks_y; ++block) {
+        refresh(block);
+    }
+}
+
+void HiZBuffer::clear() {
+    // Call after clearing the z-buffer itself
+    std::fill(block_farthest.begin(), block_farthest.end(), 0.0);
+    std::fill(block_nearest.begin(), block_nearest.end(), 0.0);
+    std::fill(dirty.begin(), dirty.end(), 0);
+}
+
+void HiZBuffer::refresh(int block) {
+    // Rescans the block's pixels in the z-buffer
+    int min_x = (block % blocks_x) * HIZ_BLOCK_SIZE;
+    int min_y = (block / blocks_x) * HIZ_BLOCK_SIZE;
+    int max_x = std::min(min_x + HIZ_BLOCK_SIZE, zbuffer->get_width());
+    int max_y = std::min(min_y + HIZ_BLOCK_SIZE, zbuffer->get_height());
+    const float *depths = zbuffer->buffer();
+    int width = zbuffer->get_width();
+    float farthest = depths[min_x + min_y * width];
+    float nearest = farthest;
+    for (int y = min_y; y < max_y; ++y) {
+        for (int x = min_x; x < max_x; ++x) {
+            float depth = depths[x + y * width];
+            farthest = std::min(farthest, depth);
+            nearest = std::max(nearest, depth);
+        }
+    }
+    block_farthest[block] = farthest;
+    block_nearest[block] = nearest;
+    dirty[block] = 0;
+}
+
+void HiZBuffer::record_write(int block_x, int block_y, double depth) {
+    // Called after depths up to `depth` were written into the block.
+    // The nearest depth stays exact; the farthest can only have grown,
+    // so the stale value is still a valid lower bound until refreshed.
+    int block = block_x + block_y * blocks_x;
+    block_nearest[block] = std::max(block_nearest[block], depth);
+    dirty[block] = 1;
+}
+
+bool HiZBuffer::occludes(int block_x, int block_y, double nearest_depth) {
+    // True if every pixel in the block is already in front of nearest_depth,
+    // so nothing at or behind nearest_depth can pass the depth test there.
+    // Only rescans the block when the stale bound cannot decide.
+    int block = block_x + block_y * blocks_x;
+    if (nearest_depth >= block_nearest[block]) {
+        return false;
+    }
+    if (nearest_depth < block_farthest[block]) {
+        return true;
+    }
+    if (dirty[block]) {
+        refresh(block);
+        return nearest_depth < block_farthest[block];
+    }
+    return false;
+}
+
+double HiZBuffer::farthest(int block_x, int block_y) {
+    int block = block_x + block_y * blocks_x;
+    if (dirty[block]) {
+        refresh(block);
+    }
+    return block_farthest[block];
+}
+
+double HiZBuffer::nearest(int block_x, int block_y) {
+    int block = block_x + block_y * blocks_x;
+    if (dirty[block]) {
+        refresh(block);
+    }
+    return block_nearest[block];
+}
+
+void HiZBuffer::count_rejections(long blocks, long pixels, bool whole_triangle) {
+    rejected_blocks += blocks;
+    skipped_pixels += pixels;
+    if (whole_triangle) {
+        ++rejected_triangles;
+    }
+}
+
+long HiZBuffer::get_rejected_triangles() const {
+    return rejected_triangles;
+}
+
+long HiZBuffer::get_rejected_blocks() const {
+    return rejected_blocks;
+}
+
+long HiZBuffer::get_skipped_pixels() const {
+    return skipped_pixels;
+}
+
+void HiZBuffer::reset_stats() {
+    rejected_triangles = 0;
+    rejected_blocks = 0;
+    skipped_pixels = 0;
+}
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include "image_writer.h"
+
+ImageWriter::ImageWriter(int nencoders) : encoders(nencoders) {
+    worker = std::thread(&ImageWriter::worker_loop, this);
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+    worker.join();
+}
+
+void ImageWriter::write(TGAImage image, std::string filename, bool rle, bool bottom_up) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(Job{std::move(image), std::move(filename), rle, bottom_up});
+    }
+    job_ready.notify_one();
+}
+
+bool ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [&]{ return jobs.empty() && !writing; });
+    bool succeeded = !failed;
+    failed = false;
+    return succeeded;
+}
+
+void ImageWriter::worker_loop() {
+    // Drains the queue before stopping, so nothing queued is lost
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [&]{ return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            writing = true;
+        }
+        bool succeeded = write_job(job);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writing = false;
+            failed = failed || !succeeded;
+        }
+        idle.notify_all();
+    }
+}
+
+bool ImageWriter::write_job(const Job &job) {
+    // Bands of at least 16 rows, a few per encoder so uneven ones even out
+    const int min_band = 16;
+    int height = job.image.get_height();
+    int nbands = std::max(1, std::min(height / min_band, encoders.size() * 4));
+    std::vector<std::vector<unsigned char>> parts(nbands);
+    encoders.parallel_for(nbands, [&](int band, int) {
+        job.image.encode_rows(height * band / nbands, height * (band + 1) / nbands, job.rle, parts[band]);
+    });
+    return job.image.write_encoded(job.filename.c_str(), job.rle, job.bottom_up, parts);
+}
+
+ImageWriter& image_writer() {
+    static ImageWriter writer;
+    return writer;
+}
@@ -1,21 +1,31 @@
 #include <vector>
 #include <cmath>
 #include <chrono>
+#include <memory>
 #include <iostream>
 #include <algorithm>
 #include <stdexcept>
 #include <random>
+#include <cstring>
+#include <set>
+#include <string>
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
 #include "our_gl.h"
 #include "shaders.h"
+#include "gbuffer.h"
+#include "asset_cache.h"
+#include "image_writer.h"
+#include "frame_sink.h"
+#include "thread_pool.h"
+#include "benchmarks.h"
 
-std::vector<Model *> models;
+std::vector<std::unique_ptr<Model>> models;
 
 Vector3d g_ORIGIN(0.0, 0.0, 0.0);
 Vector3d g_CAMERA_POS(0.0, 0.0, 100.0);
-Vector3d g_LIGHT_DIRECTION(0.33, 0.33, 0.33);
+Vector3r g_LIGHT_DIRECTION(0.33, 0.33, 0.33);
 Vector3d g_UPWARDS(0, 1.0, 0.0);
 const double PI = std::atan(1.0)*4;
 //extern const int SCREEN_X;
@@ -24,78 +34,161 @@ const double PI = std::atan(1.0)*4;
 //extern Matrix g_PROJECTION;
 //extern Matrix g_MODELVIEW;
 TGAImage g_SHADOWBUFFER;
+const bool TILED_RENDERING = true;
+// Store texture maps in 4x4 tiles instead of row by row
+const bool TILED_TEXTURES = false;
+// Light the final pass once per visible pixel from a G-buffer
+// instead of once per fragment that passes the depth test
+const bool DEFERRED_SHADING = false;
+// Stream the color frame to FRAME_STREAM instead of writing output.tga:
+// "-" for stdout, with the log moved to stderr, or a named pipe an
+// encoder reads from
+const bool STREAM_FRAMES = false;
+const char *const FRAME_STREAM = "-";
+const FrameSink::Format FRAME_STREAM_FORMAT = FrameSink::Y4M;
+// What --benchmark can be given, see benchmarks.h
+const std::vector<std::string> BENCHMARKS = {"shaders", "inverse", "textures", "tga-decode"};
 //double CAMERA_SPEED = 0.5;
 
 
-void draw_frame(std::vector<Model*> models/*, SDL_Renderer*& renderer*/) {
+template <class Shader>
+void render_pass(Shader &shader, int nfaces, DepthBuffer &zbuffer, TGAImage &image, HiZBuffer &hiz,
+                 CullMode cull, PrimitiveStats &stats) {
+    if (TILED_RENDERING) {
+        draw_faces_tiled(shader, nfaces, zbuffer, image, &hiz, cull, &stats);
+    } else {
+        draw_faces(shader, nfaces, zbuffer, image, &hiz, cull, &stats);
+    }
+}
+
+
+void print_pass_stats(const char *pass, const HiZBuffer &hiz, const PrimitiveStats &stats) {
+    std::cout << pass << " pass: culled " << stats.culled << ", rejected " << stats.rejected
+              << ", clipped " << stats.clipped << " triangles\n";
+    std::cout << pass << " pass: Hi-Z rejected " << hiz.get_rejected_triangles() << " triangles, "
+              << hiz.get_rejected_blocks() << " blocks, "
+              << hiz.get_skipped_pixels() << " pixels\n";
+}
+
+
+void draw_frame(const std::vector<std::unique_ptr<Model>> &models, FrameSink *frames,
+                const std::set<std::string> &benchmarks/*, SDL_Renderer*& renderer*/) {
 
     auto model_end_time = std::chrono::high_resolution_clock::now();
     TGAImage image(SCREEN_X, SCREEN_Y, TGAImage::RGB);
     TGAImage ssao_buffer(SCREEN_X, SCREEN_Y, TGAImage::RGB);
-	TGAImage zbuffer(SCREEN_X, SCREEN_Y, TGAImage::GRAYSCALE);
+    DepthBuffer shadow_depth(SCREEN_X, SCREEN_Y);
+    DepthBuffer zbuffer(SCREEN_X, SCREEN_Y);
     TGAImage g_SHADOWBUFFER(SCREEN_X, SCREEN_Y, TGAImage::GRAYSCALE);
+    HiZBuffer shadow_hiz(shadow_depth);
+    HiZBuffer hiz(zbuffer);
+    PrimitiveStats shadow_stats;
+    PrimitiveStats stats;
 
     // Shadowbuffer pass
     for (auto& model: models) {
         lookat(g_LIGHT_DIRECTION, g_ORIGIN, g_UPWARDS);
         viewport(0, 0, SCREEN_X, SCREEN_Y);
         projection(0);
+        std::vector<Vector4r> vertex_buffer = transform_vertices(*model, g_VIEWPORT * g_PROJECTION * g_MODELVIEW);
         DepthShader shader;
-        shader.model = model;
-        for (int i=0; i < model->nfaces(); ++i) {
-            Vector4d screen_coords[3];
-            for (int j = 0; j < 3; ++j){
-                // The vertex shader replaces the world to screen calculation
-                screen_coords[j] = shader.vertex(i, j);
-            }
-            Triangle triangle(screen_coords[0], screen_coords[1], screen_coords[2], g_SHADOWBUFFER);
-            triangle.draw_texture(zbuffer, g_SHADOWBUFFER, shader);
-        }
+        shader.model = model.get();
+        shader.vertex_buffer = &vertex_buffer;
+        render_pass(shader, model->nfaces(), shadow_depth, g_SHADOWBUFFER, shadow_hiz, CULL_CW, shadow_stats);
     }
     
+    print_pass_stats("Shadow", shadow_hiz, shadow_stats);
     Matrix MShadow = g_VIEWPORT * g_PROJECTION * g_MODELVIEW;
- 	zbuffer.clear();
  
     // Final rendering
+    GBuffer gbuffer(SCREEN_X, SCREEN_Y);
+    std::vector<ShadowShader> materials;
     for (auto& model: models) {
         lookat(g_CAMERA_POS, g_ORIGIN, g_UPWARDS);
         viewport(0, 0, SCREEN_X, SCREEN_Y);
         projection(-1.0/(g_CAMERA_POS - g_ORIGIN).norm());
+        std::vector<Vector4r> vertex_buffer = transform_vertices(*model, g_VIEWPORT * g_PROJECTION * g_MODELVIEW);
         ShadowShader shader;
-        shader.model = model;
+        shader.model = model.get();
         shader.uniform_M = g_PROJECTION * g_MODELVIEW;
         shader.uniform_MIT = (g_PROJECTION * g_MODELVIEW).invert_transpose();
         shader.uniform_MShadow = MShadow * (g_VIEWPORT * g_PROJECTION * g_MODELVIEW).invert();
-        shader.shadowbuffer = g_SHADOWBUFFER;
-        for (int i=0; i < model->nfaces(); ++i) {
-            Vector4d screen_coords[3];
-            for (int j = 0; j < 3; ++j){
-                // The vertex shader replaces the world to screen calculation
-                screen_coords[j] = shader.vertex(i, j);
-            }
-            Triangle triangle(screen_coords[0], screen_coords[1], screen_coords[2], image);
-            triangle.draw_texture(zbuffer, image, shader);
+        shader.shadowbuffer = &shadow_depth;
+        if (DEFERRED_SHADING) {
+            GBufferShader geometry_shader;
+            geometry_shader.model = model.get();
+            geometry_shader.model_id = materials.size();
+            geometry_shader.gbuffer = &gbuffer;
+            geometry_shader.vertex_buffer = &vertex_buffer;
+            materials.push_back(shader);
+            render_pass(geometry_shader, model->nfaces(), zbuffer, image, hiz, CULL_CW, stats);
+        } else {
+            shader.vertex_buffer = &vertex_buffer;
+            render_pass(shader, model->nfaces(), zbuffer, image, hiz, CULL_CW, stats);
         }
     }
+    if (DEFERRED_SHADING) {
+        resolve_gbuffer(gbuffer, materials, image);
+    }
+
+    print_pass_stats("Final", hiz, stats);
 
     auto render_end_time = std::chrono::high_resolution_clock::now();
     auto render_duration = std::chrono::duration_cast<std::chrono::duration<double>>(render_end_time - model_end_time);
     std::cout << "Render done  in " << render_duration.count()*1000 << "ms\n";
-    image.flip_vertically(); // i want to have the origin at the left bottom corner of the image
-    image.write_tga_file("output.tga");
-	zbuffer.flip_vertically();
-	zbuffer.write_tga_file("zbuffer.tga");
-	ssao_buffer.flip_vertically();
-	ssao_buffer.write_tga_file("zbuffer.tga");
-    g_SHADOWBUFFER.flip_vertically(); // i want to have the origin at the left bottom corner of the image
-    g_SHADOWBUFFER.write_tga_file("shadow.tga");
+    // i want to have the origin at the left bottom corner of the image,
+    // which the files' headers say rather than the rows being flipped.
+    // They are written in the background, in this order.
+    if (frames) {
+        frames->write(image, true);
+    } else {
+        image_writer().write(std::move(image), "output.tga", true, true);
+    }
+    image_writer().write(zbuffer.to_image(MAX_DEPTH), "depth.tga", true, true);
+    image_writer().write(std::move(ssao_buffer), "zbuffer.tga", true, true);
+    image_writer().write(std::move(g_SHADOWBUFFER), "shadow.tga", true, true);
     auto output_end_time = std::chrono::high_resolution_clock::now();
     auto output_duration = std::chrono::duration_cast<std::chrono::duration<double>>(output_end_time - render_end_time);
-    std::cout << "Written out  in " << output_duration.count()*1000 << "ms\n";
+    std::cout << "Queued out   in " << output_duration.count()*1000 << "ms\n";
+    if (benchmarks.count("shaders")) {
+        benchmark_shaders(models.front().get(), shadow_depth, MShadow, g_CAMERA_POS, g_ORIGIN, g_UPWARDS);
+    }
+    if (benchmarks.count("inverse")) {
+        benchmark_inverse();
+    }
+    if (benchmarks.count("textures")) {
+        benchmark_textures("obj/african_head_diffuse.tga");
+        benchmark_textures("obj/african_head_nm.tga");
+    }
+    if (benchmarks.count("tga-decode")) {
+        benchmark_tga_decode("obj/african_head_diffuse.tga");
+        benchmark_tga_decode("obj/african_head_nm.tga");
+        benchmark_tga_decode("obj/african_head_spec.tga");
+    }
     
     //SDL_RenderPresent(renderer);    
 }
-int main() {
+int main(int argc, char **argv) {
+    // TinyRenderer [--benchmark NAME]... also runs the named benchmarks;
+    // --mesh-cache DIR keeps the mesh caches in DIR, "" next to the OBJs
+    std::set<std::string> benchmarks;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc
+            && std::find(BENCHMARKS.begin(), BENCHMARKS.end(), argv[i + 1]) != BENCHMARKS.end()) {
+            benchmarks.insert(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--mesh-cache") == 0 && i + 1 < argc) {
+            set_mesh_cache_directory(argv[++i]);
+            continue;
+        }
+        std::cerr << "usage: " << argv[0] << " [--mesh-cache DIR] [--benchmark NAME]..., NAME one of";
+        for (const std::string &name : BENCHMARKS) {
+            std::cerr << " " << name;
+        }
+        std::cerr << "\n";
+        return 1;
+    }
     
     /* SDL_Event event;
     SDL_Renderer *renderer;
@@ -106,23 +199,47 @@ int main() {
     SDL_RenderClear(renderer);  */  
     
 
+    std::unique_ptr<FrameSink> frames;
+    if (STREAM_FRAMES) {
+        if (std::strcmp(FRAME_STREAM, "-") == 0) {
+            std::cout.rdbuf(std::cerr.rdbuf());
+        }
+        frames = std::make_unique<FrameSink>(FRAME_STREAM, FRAME_STREAM_FORMAT);
+    }
     auto start_time = std::chrono::high_resolution_clock::now();
  
 
-    auto model = new Model("obj/african_head.obj");
-    models.push_back(model);
-    //MODEL = new Model("obj/african_head_eye_outer.obj");
-    //models.push_back(MODEL);
-    model = new Model("obj/african_head_eye_inner.obj");
-    models.push_back(model);
-    model = new Model("obj/floor.obj");
-    models.push_back(model);    
+    // Models load side by side on the render pool, so start-up waits
+    // for the largest one rather than for all of them in turn
+    const char *model_files[] = {"obj/african_head.obj", /*"obj/african_head_eye_outer.obj",*/
+                                 "obj/african_head_eye_inner.obj", "obj/floor.obj"};
+    const int nmodels = sizeof(model_files) / sizeof(model_files[0]);
+    models.resize(nmodels);
+    render_pool().parallel_for(nmodels, [&](int task, int) {
+        models[task] = std::make_unique<Model>(model_files[task], true, OPTIMIZE_VERTEX_CACHE, TEXTURES_PARALLEL,
+                                               TILED_TEXTURES ? Texture::TILED : Texture::LINEAR);
+    });
     auto model_end_time = std::chrono::high_resolution_clock::now();
     auto model_duration = std::chrono::duration_cast<std::chrono::duration<double>>(model_end_time - start_time);
     std::cout << "Model loaded in " << model_duration.count() * 1000 << "ms\n";
+    AssetCache::Stats assets = asset_cache().get_stats();
+    std::cout << "Assets: " << assets.misses << " loaded, " << assets.hits << " shared, "
+              << assets.bytes / 1024 << "KB cached\n";
+    for (const std::unique_ptr<Model> &m : models) {
+        std::cout << m->nfaces() << " triangles, " << m->nverts() << " vertices, ACMR "
+                  << m->original_acmr() << " -> " << m->acmr() << "\n";
+    }
     // Vector3d camera_vel(0.0, 0.0, 0.0);
     // bool BREAK_FLAG = false;
-    draw_frame(models /*, renderer*/);
+    draw_frame(models, frames.get(), benchmarks /*, renderer*/);
+    auto flush_start_time = std::chrono::high_resolution_clock::now();
+    image_writer().flush();
+    if (frames) {
+        frames->flush();
+    }
+    auto flush_end_time = std::chrono::high_resolution_clock::now();
+    auto flush_duration = std::chrono::duration_cast<std::chrono::duration<double>>(flush_end_time - flush_start_time);
+    std::cout << "Written out  in " << flush_duration.count()*1000 << "ms more\n";
     /* while (true) {
         SDL_PollEvent(&event);
         switch (event.type){
@@ -204,7 +321,6 @@ int main() {
     SDL_DestroyWindow(window);
     SDL_Quit(); */
 
-    // delete model;
     return 0;
 }
 
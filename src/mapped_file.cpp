@@ -0,0 +1,65 @@
+#include <fstream>
+#include "mapped_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char *filename, Access access) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        length = static_cast<std::size_t>(info.st_size);
+        if (length == 0) {
+            mapping = buffer.data();
+        } else {
+            void *address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                if (access == SEQUENTIAL) {
+                    // Read ahead, and drop pages once they are read
+                    madvise(address, length, MADV_SEQUENTIAL);
+                } else {
+                    // All of it will be used, in no particular order:
+                    // fetch it now, and no more than the page on a fault
+                    madvise(address, length, MADV_WILLNEED);
+                    madvise(address, length, MADV_RANDOM);
+                }
+                mapping = static_cast<const char *>(address);
+            } else {
+                length = 0;
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapping && length) {
+        munmap(const_cast<char *>(mapping), length);
+    }
+}
+#else
+MappedFile::MappedFile(const char *filename, Access) {
+    std::ifstream in(filename, std::ifstream::in | std::ifstream::binary);
+    if (in.fail()) {
+        return;
+    }
+    in.seekg(0, std::ios::end);
+    buffer.resize(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0, std::ios::beg);
+    in.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+    if (in.fail()) {
+        return;
+    }
+    mapping = buffer.data();
+    length = buffer.size();
+}
+
+MappedFile::~MappedFile() {
+}
+#endif
@@ -0,0 +1,143 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include "mesh_cache.h"
+
+static const char MESH_CACHE_MAGIC[8] = {'T', 'R', 'M', 'E', 'S', 'H', 0, 0};
+
+static std::size_t element_size(int id) {
+    switch (id) {
+        case MESH_VERTICES: return sizeof(MeshVertex);
+        default: return sizeof(std::uint32_t);
+    }
+}
+
+static std::uint64_t align_offset(std::uint64_t offset) {
+    return (offset + 15) & ~std::uint64_t(15);
+}
+
+std::uint64_t checksum_bytes(const char *data, std::size_t size) {
+    // FNV-1a over 8 byte words, then over the bytes left. Only meant
+    // to notice that a file changed, not to resist tampering.
+    const std::uint64_t prime = 1099511628211ull;
+    std::uint64_t hash = 14695981039346656037ull ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * prime;
+    }
+    return hash;
+}
+
+static std::mutex cache_directory_mutex;
+
+static std::string &cache_directory() {
+    static std::string directory = [] {
+        const char *xdg = std::getenv("XDG_CACHE_HOME");
+        const char *home = std::getenv("HOME");
+        if (xdg && *xdg) {
+            return std::string(xdg) + "/tinyrenderer";
+        }
+        return home && *home ? std::string(home) + "/.cache/tinyrenderer" : std::string();
+    }();
+    return directory;
+}
+
+void set_mesh_cache_directory(const std::string &directory) {
+    std::lock_guard<std::mutex> lock(cache_directory_mutex);
+    cache_directory() = directory;
+}
+
+std::string mesh_cache_directory() {
+    std::lock_guard<std::mutex> lock(cache_directory_mutex);
+    return cache_directory();
+}
+
+std::string mesh_cache_path(const std::string &source_file) {
+    std::string directory = mesh_cache_directory();
+    if (directory.empty()) {
+        return source_file + ".mesh";
+    }
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    std::filesystem::path source = std::filesystem::absolute(source_file, error);
+    std::string key = source.lexically_normal().string();
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%016llx.mesh",
+                  static_cast<unsigned long long>(checksum_bytes(key.data(), key.size())));
+    return directory + "/" + source.filename().string() + suffix;
+}
+
+MeshCache::MeshCache(const char *filename, unsigned optimization) : file(filename, MappedFile::RANDOM) {
+    if (!file.data() || file.size() < sizeof(MeshCacheHeader)) {
+        return;
+    }
+    const MeshCacheHeader *candidate = reinterpret_cast<const MeshCacheHeader *>(file.data());
+    if (std::memcmp(candidate->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0
+        || candidate->version != MeshCacheHeader::VERSION || candidate->real_size != sizeof(real)
+        || candidate->optimization != optimization) {
+        return;
+    }
+    for (int id = 0; id < MESH_ARRAYS; ++id) {
+        std::uint64_t offset = candidate->offsets[id];
+        std::uint64_t bytes = candidate->counts[id] * element_size(id);
+        if (offset % 16 != 0 || offset > file.size() || bytes > file.size() - offset) {
+            return;
+        }
+    }
+    header = candidate;
+}
+
+bool write_mesh_cache(const char *filename, const MeshSourceStamp &source_stamp, std::uint64_t source_checksum,
+                      const MeshCacheContents &contents) {
+    const void *data[MESH_ARRAYS] = {contents.vertices.data(), contents.indices.data()};
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+    header.version = MeshCacheHeader::VERSION;
+    header.real_size = sizeof(real);
+    header.source_checksum = source_checksum;
+    header.source_stamp = source_stamp;
+    header.optimization = contents.optimization;
+    header.original_acmr = contents.original_acmr;
+    header.counts[MESH_VERTICES] = contents.vertices.size();
+    header.counts[MESH_INDICES] = contents.indices.size();
+    std::uint64_t offset = align_offset(sizeof(header));
+    for (int id = 0; id < MESH_ARRAYS; ++id) {
+        header.offsets[id] = offset;
+        offset = align_offset(offset + header.counts[id] * element_size(id));
+    }
+
+    // Written under a temporary name and renamed, so a reader never
+    // maps a half-written cache
+    std::string temporary = std::string(filename) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    const char padding[16] = {};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    std::uint64_t written = sizeof(header);
+    for (int id = 0; id < MESH_ARRAYS; ++id) {
+        out.write(padding, static_cast<std::streamsize>(header.offsets[id] - written));
+        std::uint64_t bytes = header.counts[id] * element_size(id);
+        if (bytes) {
+            out.write(static_cast<const char *>(data[id]), static_cast<std::streamsize>(bytes));
+        }
+        written = header.offsets[id] + bytes;
+    }
+    out.close();
+    if (out.fail() || std::rename(temporary.c_str(), filename) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
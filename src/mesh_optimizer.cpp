@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cmath>
+#include "mesh_optimizer.h"
+
+namespace {
+
+// Forsyth's tuning: the simulated cache is larger than any real one so
+// that scores fall off smoothly, the last triangle's vertices score a
+// little lower so strips do not turn back on themselves, and vertices
+// with few triangles left get a boost so no lone triangles are left behind
+const int CACHE_SIZE = 32;
+const float CACHE_DECAY_POWER = 1.5f;
+const float LAST_TRIANGLE_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+
+const int MAX_VALENCE = 64;
+
+struct ScoreTables {
+    // vertex_score is called for every cache entry after every
+    // triangle, so its two pow terms are looked up
+    float cache[CACHE_SIZE];
+    float valence[MAX_VALENCE];
+    ScoreTables() {
+        for (int i = 0; i < CACHE_SIZE; ++i) {
+            float scale = 1.0f / (CACHE_SIZE - 3);
+            cache[i] = i < 3 ? LAST_TRIANGLE_SCORE : std::pow(1.0f - (i - 3) * scale, CACHE_DECAY_POWER);
+        }
+        for (int i = 1; i < MAX_VALENCE; ++i) {
+            valence[i] = VALENCE_BOOST_SCALE * std::pow(static_cast<float>(i), -VALENCE_BOOST_POWER);
+        }
+        valence[0] = 0;
+    }
+};
+
+const ScoreTables SCORE_TABLES;
+
+float vertex_score(int cache_position, std::uint32_t remaining) {
+    if (remaining == 0) {
+        // Nothing left to draw with it
+        return -1.0f;
+    }
+    float score = cache_position >= 0 ? SCORE_TABLES.cache[cache_position] : 0.0f;
+    if (remaining < static_cast<std::uint32_t>(MAX_VALENCE)) {
+        return score + SCORE_TABLES.valence[remaining];
+    }
+    return score + VALENCE_BOOST_SCALE * std::pow(static_cast<float>(remaining), -VALENCE_BOOST_POWER);
+}
+
+Vector3r triangle_normal(const std::uint32_t *triangle, const std::vector<MeshVertex> &vertices) {
+    // Not normalized, so sums weight each triangle by its area
+    Vector3r v0 = vertices[triangle[0]].position;
+    return cross(vertices[triangle[1]].position - v0, vertices[triangle[2]].position - v0);
+}
+
+}
+
+double compute_acmr(const std::uint32_t *indices, std::size_t nindices, int cache_size) {
+    // A vertex is in the FIFO if fewer than cache_size misses happened
+    // since it went in, so each index is one lookup
+    if (nindices < 3) {
+        return 0;
+    }
+    std::uint32_t nvertices = *std::max_element(indices, indices + nindices) + 1;
+    std::vector<std::size_t> inserted(nvertices, 0);
+    std::size_t misses = 0;
+    for (std::size_t i = 0; i < nindices; ++i) {
+        std::uint32_t v = indices[i];
+        if (inserted[v] == 0 || misses - inserted[v] >= static_cast<std::size_t>(cache_size)) {
+            ++misses;
+            inserted[v] = misses;
+        }
+    }
+    return static_cast<double>(misses) / (nindices / 3);
+}
+
+void optimize_vertex_cache(std::vector<std::uint32_t> &indices, std::size_t nvertices) {
+    std::size_t ntriangles = indices.size() / 3;
+    if (ntriangles == 0) {
+        return;
+    }
+
+    // Each vertex's triangles not yet emitted are the first remaining[v]
+    // entries of its slice of adjacency, which starts at first[v]
+    std::vector<std::uint32_t> remaining(nvertices, 0);
+    for (std::uint32_t v : indices) {
+        ++remaining[v];
+    }
+    std::vector<std::size_t> first(nvertices + 1, 0);
+    for (std::size_t v = 0; v < nvertices; ++v) {
+        first[v + 1] = first[v] + remaining[v];
+    }
+    std::vector<std::uint32_t> adjacency(indices.size());
+    std::vector<std::uint32_t> filled(nvertices, 0);
+    for (std::size_t t = 0; t < ntriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            std::uint32_t v = indices[3 * t + k];
+            adjacency[first[v] + filled[v]++] = static_cast<std::uint32_t>(t);
+        }
+    }
+
+    std::vector<int> cache_position(nvertices, -1);
+    std::vector<float> score(nvertices);
+    for (std::size_t v = 0; v < nvertices; ++v) {
+        score[v] = vertex_score(-1, remaining[v]);
+    }
+    std::vector<float> triangle_score(ntriangles);
+    std::vector<bool> emitted(ntriangles, false);
+    for (std::size_t t = 0; t < ntriangles; ++t) {
+        triangle_score[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+    }
+
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    std::vector<std::uint32_t> cache, next_cache;
+    cache.reserve(CACHE_SIZE + 3);
+    next_cache.reserve(CACHE_SIZE + 3);
+    std::size_t best = 0;
+    std::size_t scan = 0;
+    for (std::size_t emitted_count = 0; emitted_count < ntriangles; ++emitted_count) {
+        if (best == ntriangles) {
+            // Nothing in the cache touches a triangle left, so start
+            // again from the first one not emitted
+            while (emitted[scan]) {
+                ++scan;
+            }
+            best = scan;
+        }
+        const std::uint32_t *triangle = &indices[3 * best];
+        result.insert(result.end(), triangle, triangle + 3);
+        emitted[best] = true;
+
+        // The triangle's vertices go to the front of the cache, the
+        // rest keep their order behind them
+        next_cache.clear();
+        for (int k = 0; k < 3; ++k) {
+            std::uint32_t v = triangle[k];
+            if (std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end()) {
+                next_cache.push_back(v);
+            }
+            // One adjacency entry per corner, even in degenerate triangles
+            std::uint32_t *begin = &adjacency[first[v]];
+            std::uint32_t *end = begin + remaining[v];
+            std::uint32_t *found = std::find(begin, end, static_cast<std::uint32_t>(best));
+            std::swap(*found, end[-1]);
+            --remaining[v];
+        }
+        for (std::uint32_t v : cache) {
+            if (std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end()) {
+                next_cache.push_back(v);
+            }
+        }
+        for (std::size_t i = 0; i < next_cache.size(); ++i) {
+            std::uint32_t v = next_cache[i];
+            cache_position[v] = i < static_cast<std::size_t>(CACHE_SIZE) ? static_cast<int>(i) : -1;
+        }
+
+        // Only triangles around vertices in the cache get new scores,
+        // and the best of them is the next one to emit. It is picked
+        // while still updating, so a triangle around two cached vertices
+        // may be compared before its second update; that costs little
+        // order and saves a second pass.
+        best = ntriangles;
+        float best_score = 0;
+        for (std::uint32_t v : next_cache) {
+            float updated = vertex_score(cache_position[v], remaining[v]);
+            float delta = updated - score[v];
+            score[v] = updated;
+            for (std::uint32_t i = 0; i < remaining[v]; ++i) {
+                std::uint32_t t = adjacency[first[v] + i];
+                triangle_score[t] += delta;
+                if (triangle_score[t] > best_score) {
+                    best_score = triangle_score[t];
+                    best = t;
+                }
+            }
+        }
+        if (next_cache.size() > static_cast<std::size_t>(CACHE_SIZE)) {
+            next_cache.resize(CACHE_SIZE);
+        }
+        cache.swap(next_cache);
+    }
+    indices.swap(result);
+}
+
+void optimize_overdraw(std::vector<std::uint32_t> &indices, const std::vector<MeshVertex> &vertices,
+                       std::size_t cluster_size) {
+    std::size_t ntriangles = indices.size() / 3;
+    std::size_t nclusters = (ntriangles + cluster_size - 1) / cluster_size;
+    if (nclusters < 2) {
+        return;
+    }
+    struct Cluster {
+        std::size_t start;
+        std::size_t end;
+        real sort_key;
+    };
+    std::vector<Cluster> clusters(nclusters);
+    std::vector<Vector3r> centroids(nclusters);
+    std::vector<Vector3r> normals(nclusters);
+    Vector3r mesh_centroid(0, 0, 0);
+    real mesh_area = 0;
+    for (std::size_t c = 0; c < nclusters; ++c) {
+        clusters[c].start = c * cluster_size;
+        clusters[c].end = std::min(ntriangles, (c + 1) * cluster_size);
+        Vector3r centroid(0, 0, 0), normal(0, 0, 0);
+        real area = 0;
+        for (std::size_t t = clusters[c].start; t < clusters[c].end; ++t) {
+            const std::uint32_t *triangle = &indices[3 * t];
+            Vector3r n = triangle_normal(triangle, vertices);
+            real weight = n.norm();
+            Vector3r center = (vertices[triangle[0]].position + vertices[triangle[1]].position
+                              + vertices[triangle[2]].position) * (real(1) / 3);
+            centroid = centroid + center * weight;
+            normal = normal + n;
+            area += weight;
+        }
+        mesh_centroid = mesh_centroid + centroid;
+        mesh_area += area;
+        centroids[c] = area > 0 ? centroid * (1 / area) : centroid;
+        normals[c] = normal;
+    }
+    if (mesh_area > 0) {
+        mesh_centroid = mesh_centroid * (1 / mesh_area);
+    }
+    for (std::size_t c = 0; c < nclusters; ++c) {
+        Vector3r normal = normals[c];
+        real length = normal.norm();
+        clusters[c].sort_key = length > 0 ? (centroids[c] - mesh_centroid) * normal * (1 / length) : 0;
+    }
+    // Stable, so clusters that tie keep the vertex cache order
+    std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) {
+        return a.sort_key > b.sort_key;
+    });
+
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    for (const Cluster &cluster : clusters) {
+        result.insert(result.end(), indices.begin() + 3 * cluster.start, indices.begin() + 3 * cluster.end);
+    }
+    indices.swap(result);
+}
+
+void optimize_vertex_fetch(std::vector<std::uint32_t> &indices, std::vector<MeshVertex> &vertices) {
+    const std::uint32_t UNUSED = 0xffffffff;
+    std::vector<std::uint32_t> remap(vertices.size(), UNUSED);
+    std::vector<MeshVertex> result;
+    result.reserve(vertices.size());
+    for (std::uint32_t &v : indices) {
+        if (remap[v] == UNUSED) {
+            remap[v] = static_cast<std::uint32_t>(result.size());
+            result.push_back(vertices[v]);
+        }
+        v = remap[v];
+    }
+    // Vertices no triangle uses are dropped
+    vertices.swap(result);
+}
@@ -1,122 +1,493 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <vector>
 #include "model.h"
 #include "tgaimage.h"
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_(), subsurfacemap_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            Vector3d v;
-            for (int i=0; i < 3; ++i){
-				iss >> v[i];
-			}
-            v.x = v[0];
-            v.y = v[1];
-            v.z = v[2];
-            verts_.push_back(v);
-		} else if (!line.compare(0, 3, "vt ")) {
-			iss >> trash >> trash;
-			Vector2d uv;
-			for (int i=0; i < 2; ++i){
-				iss >> uv[i];
-			}
-			uv_.push_back(uv);
-		} else if (!line.compare(0, 3, "vn ")) {
-			iss >> trash >> trash;
-			Vector3d n;
-			for (int i=0; i < 3; ++i){
-				iss >> n[i];
-			}
-			norms_.push_back(n);
-        } else if (!line.compare(0, 2, "f ")) {
-            std::vector<Vector3i> f;
-            Vector3i temp;
-            iss >> trash;
-            while (iss >> temp[0] >> trash >> temp[1] >> trash >> temp[2]) {
-				for (int i = 0; i < 3; ++i){
-					--temp[i]; // in wavefront obj all indices start at 1, not zero
-				}
-				f.push_back(temp);
-			}
-        faces_.push_back(f);
+#include "thread_pool.h"
+#include "mapped_file.h"
+#include "mesh_optimizer.h"
+#include "asset_cache.h"
+
+namespace {
+
+struct FaceCorner {
+    // Where a triangle corner's position, uv and normal are in the OBJ's
+    // lists; NO_INDEX if the corner has no uv or normal
+    static const std::uint32_t NO_INDEX = 0xffffffff;
+    std::uint32_t vert;
+    std::uint32_t uv;
+    std::uint32_t norm;
+};
+
+struct ObjChunk {
+    // What one slice of an OBJ file holds, with faces already split
+    // into triangles. Negative (relative) indices are resolved against
+    // the chunk's own counts, which may wrap below zero, and listed in
+    // relative as corner * 3 + component so the merge can shift them.
+    std::vector<Vector3r> verts;
+    std::vector<Vector2r> uvs;
+    std::vector<Vector3r> norms;
+    std::vector<FaceCorner> corners;
+    std::vector<size_t> relative;
+    // The face being parsed, and which of its indices are relative
+    std::vector<FaceCorner> polygon;
+    std::vector<int> polygon_relative;
+};
+
+std::uint32_t FaceCorner::*const CORNER_FIELDS[3] = {&FaceCorner::vert, &FaceCorner::uv, &FaceCorner::norm};
+
+const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    return p;
+}
+
+template <class T>
+const char *parse_number(const char *p, const char *end, T &out) {
+    // Reads one number at p, leaving out at zero and p where it was if
+    // there is none. from_chars does not take a leading plus sign.
+    out = 0;
+    if (p < end && *p == '+') {
+        ++p;
+    }
+    std::from_chars_result result = std::from_chars(p, end, out);
+    if (result.ec != std::errc()) {
+        out = 0;
+    }
+    return result.ptr;
+}
+
+// Every power of ten a double holds exactly
+const double POWERS_OF_TEN[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+template <class T>
+const char *parse_decimal(const char *p, const char *end, T &out) {
+    // Reads a coordinate. Plain decimals with at most 15 digits, which
+    // is nearly all of them, become an integer that a double holds
+    // exactly divided by an exact power of ten: one correctly rounded
+    // division, so the same value from_chars would give, only faster.
+    // Anything else goes through parse_number.
+    const char *start = p;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    for (; p < end && static_cast<unsigned>(*p - '0') < 10; ++p, ++digits) {
+        mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && static_cast<unsigned>(*p - '0') < 10; ++p, ++digits, ++decimals) {
+            mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+        }
+    }
+    if (digits == 0 || digits > 15 || (p < end && (*p == 'e' || *p == 'E'))) {
+        return parse_number(start, end, out);
+    }
+    double value = static_cast<double>(mantissa) / POWERS_OF_TEN[decimals];
+    out = static_cast<T>(negative ? -value : value);
+    return p;
+}
+
+template <class Vec>
+void parse_vector(const char *p, const char *end, int n, std::vector<Vec> &out) {
+    Vec v;
+    for (int i = 0; i < n; ++i) {
+        p = parse_decimal(skip_blanks(p, end), end, v[i]);
+    }
+    out.push_back(v);
+}
+
+const char *parse_index(const char *p, const char *end, int &out) {
+    // Reads a face index, leaving out at zero, which no index can be,
+    // and p where it was if there is none
+    const char *start = p;
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        ++p;
+    }
+    int value = 0;
+    const char *digits = p;
+    for (; p < end && static_cast<unsigned>(*p - '0') < 10; ++p) {
+        value = value * 10 + (*p - '0');
+    }
+    if (p == digits) {
+        out = 0;
+        return start;
+    }
+    out = negative ? -value : value;
+    return p;
+}
+
+void parse_face(const char *p, const char *end, ObjChunk &chunk) {
+    // Corners are v, v/vt, v//vn or v/vt/vn. A polygon becomes a fan of
+    // triangles around its first corner; faces of fewer than three
+    // corners are dropped.
+    const int counts[3] = {static_cast<int>(chunk.verts.size()), static_cast<int>(chunk.uvs.size()),
+                           static_cast<int>(chunk.norms.size())};
+    chunk.polygon.clear();
+    chunk.polygon_relative.clear();
+    p = skip_blanks(p, end);
+    while (p < end) {
+        int raw[3] = {0, 0, 0};
+        const char *next = parse_index(p, end, raw[0]);
+        if (next == p) {
+            break;
+        }
+        p = next;
+        if (p < end && *p == '/') {
+            ++p;
+            if (p < end && *p != '/') {
+                p = parse_index(p, end, raw[1]);
+            }
+            if (p < end && *p == '/') {
+                p = parse_index(p + 1, end, raw[2]);
+            }
+        }
+        FaceCorner corner;
+        int relative = 0;
+        for (int i = 0; i < 3; ++i) {
+            // In wavefront obj indices start at 1, and negative ones count back from the end
+            std::uint32_t &index = corner.*CORNER_FIELDS[i];
+            if (raw[i] > 0) {
+                index = static_cast<std::uint32_t>(raw[i] - 1);
+            } else if (raw[i] < 0) {
+                index = static_cast<std::uint32_t>(counts[i] + raw[i]);
+                relative |= 1 << i;
+            } else {
+                index = FaceCorner::NO_INDEX;
+            }
         }
+        chunk.polygon.push_back(corner);
+        chunk.polygon_relative.push_back(relative);
+        p = skip_blanks(p, end);
+    }
+    for (size_t second = 1; second + 1 < chunk.polygon.size(); ++second) {
+        for (size_t k : {size_t(0), second, second + 1}) {
+            for (int i = 0; i < 3; ++i) {
+                if ((chunk.polygon_relative[k] >> i) & 1) {
+                    chunk.relative.push_back(chunk.corners.size() * 3 + i);
+                }
+            }
+            chunk.corners.push_back(chunk.polygon[k]);
+        }
+    }
+}
+
+void parse_chunk(const char *p, const char *end, ObjChunk &chunk) {
+    // Parses whole lines in [p, end); other statements are ignored
+    while (p < end) {
+        const char *line_end = std::find(p, end, '\n');
+        const char *content_end = line_end;
+        if (content_end > p && content_end[-1] == '\r') {
+            --content_end;
+        }
+        p = skip_blanks(p, content_end);
+        if (content_end - p >= 2) {
+            bool blank_after_1 = p[1] == ' ' || p[1] == '\t';
+            bool blank_after_2 = content_end - p >= 3 && (p[2] == ' ' || p[2] == '\t');
+            if (p[0] == 'v' && blank_after_1) {
+                parse_vector(p + 2, content_end, 3, chunk.verts);
+            } else if (p[0] == 'v' && p[1] == 't' && blank_after_2) {
+                parse_vector(p + 3, content_end, 2, chunk.uvs);
+            } else if (p[0] == 'v' && p[1] == 'n' && blank_after_2) {
+                parse_vector(p + 3, content_end, 3, chunk.norms);
+            } else if (p[0] == 'f' && blank_after_1) {
+                parse_face(p + 2, content_end, chunk);
+            }
+        }
+        p = line_end < end ? line_end + 1 : end;
     }
-	load_texture(filename, "_diffuse.tga", diffusemap_);
-	load_texture(filename, "_nm.tga", normalmap_);
-	load_texture(filename, "_spec.tga", specularmap_);
-	load_texture(filename, "_SSS.tga", subsurfacemap_);
+}
+
+void weld_vertices(const std::vector<Vector3r> &verts, const std::vector<Vector2r> &uvs, const std::vector<Vector3r> &norms,
+                   const std::vector<FaceCorner> &corners, std::vector<MeshVertex> &vertices, std::vector<std::uint32_t> &indices) {
+    // Corners with the same position, uv and normal share one vertex.
+    // Those sharing a position are chained from welded[vert], so each
+    // corner only compares against the few other uses of its position.
+    // Corners without a normal take the face's and are never shared.
+    const std::uint32_t NONE = FaceCorner::NO_INDEX;
+    std::vector<std::uint32_t> welded(verts.size(), NONE);
+    std::vector<std::uint32_t> next;
+    std::vector<FaceCorner> sources;
+    vertices.reserve(verts.size());
+    next.reserve(verts.size());
+    sources.reserve(verts.size());
+    indices.resize(corners.size());
+    for (size_t i = 0; i < corners.size(); ++i) {
+        const FaceCorner &corner = corners[i];
+        std::uint32_t found = NONE;
+        if (corner.norm != NONE) {
+            for (found = welded[corner.vert]; found != NONE; found = next[found]) {
+                if (sources[found].uv == corner.uv && sources[found].norm == corner.norm) {
+                    break;
+                }
+            }
+        }
+        if (found == NONE) {
+            found = static_cast<std::uint32_t>(vertices.size());
+            MeshVertex vertex;
+            vertex.position = verts[corner.vert];
+            vertex.uv = corner.uv != NONE ? uvs[corner.uv] : Vector2r(0, 0);
+            if (corner.norm != NONE) {
+                vertex.normal = Vector3r(norms[corner.norm]).normalize();
+            } else {
+                const FaceCorner *face = &corners[i - i % 3];
+                Vector3r v0 = verts[face[0].vert];
+                vertex.normal = cross(verts[face[1].vert] - v0, verts[face[2].vert] - v0).normalize();
+            }
+            vertices.push_back(vertex);
+            sources.push_back(corner);
+            next.push_back(welded[corner.vert]);
+            if (corner.norm != NONE) {
+                welded[corner.vert] = found;
+            }
+        }
+        indices[i] = found;
+    }
+}
+
+}
+
+static void load_obj(const char *data, size_t size, unsigned optimization, Mesh &mesh) {
+    // Parses the OBJ text on the render pool in chunks of whole lines,
+    // concatenates the chunks in order, welds the corners into vertices
+    // and reorders the triangles as asked
+    const char *end = data + size;
+    const size_t min_chunk_size = 1 << 18;
+    ThreadPool &pool = render_pool();
+    size_t nchunks = std::max<size_t>(1, std::min<size_t>(size / min_chunk_size, pool.size() * 4));
+    std::vector<const char *> bounds(nchunks + 1, end);
+    bounds[0] = data;
+    for (size_t i = 1; i < nchunks; ++i) {
+        const char *split = std::max(bounds[i - 1], data + size * i / nchunks);
+        const char *newline = std::find(split, end, '\n');
+        bounds[i] = newline < end ? newline + 1 : end;
+    }
+    std::vector<ObjChunk> chunks(nchunks);
+    pool.parallel_for(static_cast<int>(nchunks), [&](int task, int) {
+        parse_chunk(bounds[task], bounds[task + 1], chunks[task]);
+    });
+
+    size_t nverts = 0, nuvs = 0, nnorms = 0, ncorners = 0;
+    for (const ObjChunk &chunk : chunks) {
+        nverts += chunk.verts.size();
+        nuvs += chunk.uvs.size();
+        nnorms += chunk.norms.size();
+        ncorners += chunk.corners.size();
+    }
+    std::vector<Vector3r> verts, norms;
+    std::vector<Vector2r> uvs;
+    std::vector<FaceCorner> corners;
+    verts.reserve(nverts);
+    uvs.reserve(nuvs);
+    norms.reserve(nnorms);
+    corners.reserve(ncorners);
+    for (ObjChunk &chunk : chunks) {
+        const std::uint32_t offsets[3] = {static_cast<std::uint32_t>(verts.size()), static_cast<std::uint32_t>(uvs.size()),
+                                          static_cast<std::uint32_t>(norms.size())};
+        for (size_t index : chunk.relative) {
+            chunk.corners[index / 3].*CORNER_FIELDS[index % 3] += offsets[index % 3];
+        }
+        verts.insert(verts.end(), chunk.verts.begin(), chunk.verts.end());
+        uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+        norms.insert(norms.end(), chunk.norms.begin(), chunk.norms.end());
+        corners.insert(corners.end(), chunk.corners.begin(), chunk.corners.end());
+    }
+
+    std::vector<MeshVertex> vertices;
+    std::vector<std::uint32_t> indices;
+    weld_vertices(verts, uvs, norms, corners, vertices, indices);
+    mesh.original_acmr = compute_acmr(indices.data(), indices.size());
+    if (optimization & OPTIMIZE_VERTEX_CACHE) {
+        optimize_vertex_cache(indices, vertices.size());
+    }
+    if (optimization & OPTIMIZE_OVERDRAW) {
+        optimize_overdraw(indices, vertices);
+    }
+    if (optimization != OPTIMIZE_NONE) {
+        optimize_vertex_fetch(indices, vertices);
+    }
+    mesh.vertices.assign(std::move(vertices));
+    mesh.indices.assign(std::move(indices));
+}
+
+static std::shared_ptr<const Mesh> load_mesh(const std::string &filename, bool use_mesh_cache, unsigned optimization) {
+    // With use_mesh_cache, maps the OBJ's cache if it was made from this
+    // OBJ with these flags, and otherwise parses the OBJ and writes it.
+    // The OBJ is only read when its size or modification time changed
+    // since the cache was written, to compare its checksum.
+    std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+    std::error_code error;
+    MeshSourceStamp stamp{std::filesystem::file_size(filename, error), 0};
+    if (!error) {
+        stamp.mtime = std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+    }
+    std::string cache_file = use_mesh_cache && !error ? mesh_cache_path(filename) : std::string();
+    std::unique_ptr<MappedFile> source;
+    if (!cache_file.empty()) {
+        mesh->cache.reset(new MeshCache(cache_file.c_str(), optimization));
+        bool matches = mesh->cache->is_valid() && mesh->cache->source_stamp() == stamp;
+        bool restamp = false;
+        if (mesh->cache->is_valid() && !matches && mesh->cache->source_stamp().size == stamp.size) {
+            // Touched or copied, perhaps without changing
+            source.reset(new MappedFile(filename.c_str()));
+            matches = source->data() && checksum_bytes(source->data(), source->size()) == mesh->cache->source_checksum();
+            restamp = matches;
+        }
+        if (matches) {
+            mesh->cache->lend(MESH_VERTICES, mesh->vertices);
+            mesh->cache->lend(MESH_INDICES, mesh->indices);
+            mesh->original_acmr = mesh->cache->original_acmr();
+            if (restamp) {
+                // Spares the next run the checksum
+                write_mesh_cache(cache_file.c_str(), stamp, mesh->cache->source_checksum(),
+                                 {optimization, mesh->original_acmr, mesh->vertices, mesh->indices});
+            }
+        } else {
+            // Missing, made from another version of the OBJ or optimized differently
+            mesh->cache.reset();
+        }
+    }
+    if (!mesh->cache) {
+        if (!source) {
+            source.reset(new MappedFile(filename.c_str()));
+        }
+        if (!source->data()) return mesh;
+        load_obj(source->data(), source->size(), optimization, *mesh);
+        if (!cache_file.empty()) {
+            write_mesh_cache(cache_file.c_str(), stamp, checksum_bytes(source->data(), source->size()),
+                             {optimization, mesh->original_acmr, mesh->vertices, mesh->indices});
+        }
+    }
+    return mesh;
+}
+
+std::size_t Mesh::memory_size() const {
+    return vertices.size() * sizeof(MeshVertex) + indices.size() * sizeof(std::uint32_t);
+}
+
+Model::Model(const char *filename, bool use_mesh_cache, unsigned optimization, TextureLoading textures,
+             Texture::Layout texture_layout)
+    : mesh_(), filename_(filename), texture_layout_(texture_layout), diffusemap_("_diffuse.tga"), normalmap_("_nm.tga"), specularmap_("_spec.tga"),
+      subsurfacemap_("_SSS.tga") {
+    // The maps decode on the render pool while the geometry is parsed
+    // or read from its cache. Loaded from a render pool task, as when
+    // models load side by side, the model reads them in turn.
+    TextureMap *maps[] = {&diffusemap_, &normalmap_, &specularmap_, &subsurfacemap_};
+    std::function<std::shared_ptr<const Mesh>(const std::string &)> load = [&](const std::string &path) {
+        return load_mesh(path, use_mesh_cache, optimization);
+    };
+    int nloads = textures == TEXTURES_PARALLEL ? 5 : 1;
+    render_pool().parallel_for(nloads, [&](int task, int) {
+        if (task == 0) {
+            mesh_ = asset_cache().get("mesh " + std::to_string(optimization), filename, load);
+        } else {
+            texture(*maps[task - 1]);
+        }
+    });
 }
 
 Model::~Model() {
 }
 
 int Model::nverts() {
-    return static_cast<int>(verts_.size());
+    return static_cast<int>(mesh_->vertices.size());
 }
 
 int Model::nfaces() {
-    return static_cast<int>(faces_.size());
+    return static_cast<int>(mesh_->indices.size() / 3);
 }
 
-std::vector<int> Model::face(int index) {
-	std::vector<int> face;
-	for (int i=0; i < static_cast<int>(faces_[index].size()); ++i){
-		face.push_back(faces_[index][i][0]);
-	}
-    return face;
+const std::uint32_t *Model::face(int index) {
+    return mesh_->indices.data() + 3 * index;
 }
 
-Vector3d Model::vert(int index) {
-    return verts_[index];
+double Model::acmr() {
+    return compute_acmr(mesh_->indices.data(), mesh_->indices.size());
 }
 
-Vector3d Model::vert(int iface, int nthvert) {
-    return verts_[faces_[iface][nthvert][0]];
+double Model::original_acmr() {
+    return mesh_->original_acmr;
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &image){
-	std::string texturefile(filename);
+Vector3r Model::vert(int index) {
+    return mesh_->vertices[index].position;
+}
+
+Vector3r Model::vert(int iface, int nthvert) {
+    return mesh_->vertices[mesh_->indices[3 * iface + nthvert]].position;
+}
+
+int Model::vert_index(int iface, int nthvert) {
+    return static_cast<int>(mesh_->indices[3 * iface + nthvert]);
+}
+
+void Model::load_texture(TextureMap &map){
+	std::string texturefile(filename_);
 	size_t dot = texturefile.find_last_of(".");
 	if (dot != std::string::npos) {
-		texturefile = texturefile.substr(0, dot) + std::string(suffix);
-		image.read_tga_file(texturefile.c_str());
-		image.flip_vertically();
+		texturefile = texturefile.substr(0, dot) + std::string(map.suffix);
+	}
+	Texture::Layout layout = texture_layout_;
+	std::function<std::shared_ptr<const Texture>(const std::string &)> load = [layout](const std::string &path) {
+		// A LINEAR texture of an uncompressed file samples level 0 in
+		// place from the mapping, shared with every process that maps
+		// it. Tiling copies every texel, so it decodes the file instead.
+		TGAImage image;
+		if (layout == Texture::LINEAR) {
+			image.map_tga_file(path.c_str(), true);
+		} else {
+			image.read_tga_file(path.c_str(), true);
+		}
+		return std::make_shared<const Texture>(image, layout);
+	};
+	std::string kind = layout == Texture::TILED ? "tiled texture" : "texture";
+	map.texture = dot != std::string::npos ? asset_cache().get(kind, texturefile.c_str(), load)
+	                                       : std::make_shared<const Texture>();
+}
+
+const Texture &Model::texture(TextureMap &map) {
+	// Once loaded, a sample only pays for the flag check
+	if (!map.loaded.load(std::memory_order_acquire)) {
+		std::call_once(map.once, [&] {
+			load_texture(map);
+			map.loaded.store(true, std::memory_order_release);
+		});
 	}
+	return *map.texture;
 }
 
-TGAColor Model::diffuse(Vector2d uvf){
-	return diffusemap_.get(uvf[0] * diffusemap_.get_width() , uvf.y * diffusemap_.get_height());
+TGAColor Model::diffuse(Vector2r uvf, real uv_lod){
+	return texture(diffusemap_).sample(uvf, uv_lod);
 }
 
-Vector3d Model::normalmap(Vector2d uvf){
-    TGAColor color = normalmap_.get(uvf[0] * normalmap_.get_width(), uvf[1] * normalmap_.get_height());
-	return Vector3d((128.0-color.bgra[2])/128.0, (128.0-color.bgra[1])/128.0, (color.bgra[0] -128.0)/-128.0);
+Vector3r Model::normalmap(Vector2r uvf, real uv_lod){
+    TGAColor color = texture(normalmap_).sample(uvf, uv_lod);
+	return Vector3r((128.0-color.bgra[2])/128.0, (128.0-color.bgra[1])/128.0, (color.bgra[0] -128.0)/-128.0);
 }
 
-double Model::specularmap(Vector2d uvf){
-	return specularmap_.get(uvf[0] * specularmap_.get_width(), uvf[1] * specularmap_.get_height()).bgra[0] / 1.0;
+double Model::specularmap(Vector2r uvf, real uv_lod){
+	return texture(specularmap_).sample(uvf, uv_lod).bgra[0] / 1.0;
 }
 
-TGAColor Model::subsurfacemap(Vector2d uvf){
-	return subsurfacemap_.get(uvf[0] * subsurfacemap_.get_width(), uvf[1] * subsurfacemap_.get_height());
+TGAColor Model::subsurfacemap(Vector2r uvf, real uv_lod){
+	return texture(subsurfacemap_).sample(uvf, uv_lod);
 }
 
-Vector2d Model::uv(int iface, int nvert){
-	int index = faces_[iface][nvert][1];
-	return Vector2d(uv_[index].x, uv_[index].y);
+Vector2r Model::uv(int iface, int nvert){
+	return mesh_->vertices[mesh_->indices[3 * iface + nvert]].uv;
 }
 
-Vector3d Model::norm(int iface, int nvert) {
-	int index = faces_[iface][nvert][2];
-	return norms_[index].normalize();
+Vector3r Model::norm(int iface, int nvert) {
+	return mesh_->vertices[mesh_->indices[3 * iface + nvert]].normal;
 }
@@ -7,11 +7,18 @@
 #include "geometry.h"
 #include "our_gl.h"
 #include "shaders.h"
+#include "simd.h"
+#include "hiz_buffer.h"
+#include "depth_buffer.h"
 
 const int MAX_DEPTH = 255;
 const double GAMMA = 1.0;
 const int SCREEN_X = 1000;
 const int SCREEN_Y = 1000;
+#ifdef TINYRENDERER_FIXED_POINT
+const int SUBPIXEL_BITS = 8;
+const long long SUBPIXEL_ONE = 1LL << SUBPIXEL_BITS;
+#endif
 
 Matrix g_VIEWPORT;
 Matrix g_PROJECTION;
@@ -73,7 +80,10 @@ void draw_line(Vector3i point0, Vector3i point1, TGAImage &image, TGAColor color
 }
 
 
-Triangle::Triangle(Vector4d point_0, Vector4d point_1, Vector4d point_2, TGAImage &image) {	
+Triangle::Triangle() : determinant(0), inv_area(0), clipped(false) {
+}
+
+Triangle::Triangle(Vector4d point_0, Vector4d point_1, Vector4d point_2, TGAImage &image) : clipped(false) {	
 	
     // Triangle constructor, which caches 
     // some operations for the barycentric coordinate calculation
@@ -85,14 +95,62 @@ Triangle::Triangle(Vector4d point_0, Vector4d point_1, Vector4d point_2, TGAImag
 	vec_2 = proj<3>(screen_coords[2] - screen_coords[0]);
 	vec_3 = proj<3>(screen_coords[2] - screen_coords[1]);
 	determinant = (vec_1.x * vec_2.y) - (vec_1.y * vec_2.x);
-		
-	std::vector<int> x_coords = {screen_coords[0][0], screen_coords[1][0], screen_coords[2][0]};
-	std::vector<int> y_coords  = {screen_coords[0][1], screen_coords[1][1], screen_coords[2][1]};
-	std::sort(x_coords.begin(), x_coords.end());
-	std::sort(y_coords.begin(), y_coords.end());
-	
-	bounding_min = Vector2d(static_cast<int>(std::max(x_coords.front(), 0)), static_cast<int>(std::max(y_coords.front(), 0)));
-	bounding_max = Vector2d(static_cast<int>(std::min(x_coords.back(), image.get_height()-1)), static_cast<int>(std::min(y_coords.back(), image.get_height()-1)));
+
+#ifdef TINYRENDERER_FIXED_POINT
+	// Snap the vertices to the sub-pixel grid. Everything from here on is
+	// integer, so coverage does not depend on the compiler or the order of
+	// floating point operations.
+	for (int i = 0; i < 3; ++i) {
+		fixed_x[i] = std::llround(screen_coords[i][0] * SUBPIXEL_ONE);
+		fixed_y[i] = std::llround(screen_coords[i][1] * SUBPIXEL_ONE);
+	}
+	determinant = static_cast<double>((fixed_x[1] - fixed_x[0]) * (fixed_y[2] - fixed_y[0])
+	                                - (fixed_y[1] - fixed_y[0]) * (fixed_x[2] - fixed_x[0]));
+	// Pixels are sampled at their integer coordinates, so the box runs from
+	// the first sample at or after the minimum to the last at or before the maximum
+	double min_x = std::min(fixed_x[0], std::min(fixed_x[1], fixed_x[2])) / static_cast<double>(SUBPIXEL_ONE);
+	double min_y = std::min(fixed_y[0], std::min(fixed_y[1], fixed_y[2])) / static_cast<double>(SUBPIXEL_ONE);
+	double max_x = std::max(fixed_x[0], std::max(fixed_x[1], fixed_x[2])) / static_cast<double>(SUBPIXEL_ONE);
+	double max_y = std::max(fixed_y[0], std::max(fixed_y[1], fixed_y[2])) / static_cast<double>(SUBPIXEL_ONE);
+	bounding_min = Vector2i(std::max(static_cast<int>(std::ceil(min_x)), 0), std::max(static_cast<int>(std::ceil(min_y)), 0));
+	bounding_max = Vector2i(std::min(static_cast<int>(std::floor(max_x)), image.get_width()-1), std::min(static_cast<int>(std::floor(max_y)), image.get_height()-1));
+#else
+	double min_x = std::min(screen_coords[0][0], std::min(screen_coords[1][0], screen_coords[2][0]));
+	double min_y = std::min(screen_coords[0][1], std::min(screen_coords[1][1], screen_coords[2][1]));
+	double max_x = std::max(screen_coords[0][0], std::max(screen_coords[1][0], screen_coords[2][0]));
+	double max_y = std::max(screen_coords[0][1], std::max(screen_coords[1][1], screen_coords[2][1]));
+	bounding_min = Vector2i(std::max(static_cast<int>(min_x), 0), std::max(static_cast<int>(min_y), 0));
+	bounding_max = Vector2i(std::min(static_cast<int>(max_x), image.get_width()-1), std::min(static_cast<int>(max_y), image.get_height()-1));
+#endif
+	if (determinant != 0) {
+		setup_edges();
+	}
+}
+
+void Triangle::set_parent(mat<3, 3, double> barycentric_to_parent) {
+    // Marks this triangle as a piece of a clipped one. Column k holds
+    // the barycentric coordinates of vertex k within the original
+    // triangle, whose varyings the shader still holds, so the shader
+    // gets barycentrics relative to the original.
+    clipped = true;
+    parent_barycentric = barycentric_to_parent;
+}
+
+Vector3d Triangle::shader_barycentric(Vector3d bc) {
+    return clipped ? parent_barycentric * bc : bc;
+}
+
+bool Triangle::is_drawable() const {
+    // False for degenerate triangles and ones entirely off-screen
+    return determinant != 0 && bounding_min.x <= bounding_max.x && bounding_min.y <= bounding_max.y;
+}
+
+Vector2i Triangle::get_bounding_min() const {
+    return bounding_min;
+}
+
+Vector2i Triangle::get_bounding_max() const {
+    return bounding_max;
 }
 
 void Triangle::draw_outline(TGAImage &image, TGAColor color) {
@@ -112,31 +170,6 @@ void Triangle::draw_bounding_box(TGAImage &image, TGAColor color) {
 	draw_line(Vector3i(bounding_max.x, bounding_max.y, 1), Vector3i(bounding_max.x, bounding_min.y, 1), image, color);
 }
 
-template <class T>
-Vector3d Triangle::barycentric(T point_in) {
-	// Unsubtly computes the barycentric coordinates of a point
-	// within a given triangle using the equation on
-	// wikipedia. 
-	// Takes in a 3D point (x, y, z) in Cartesian space,
-	// and a triangle made up of three points (x0, y0, z0) ... (x2, y2, z2)
-	// Returns a 3D vector (lambda_1, lambda_2, lambda_3)
-
-	if (determinant == 0) {
-		// If the matrix is non-invertible, then bail out.
-		// Return a barycentric coordinate with negative parts
-		// to indicate that the point can be discarded.
-		return Vector3d(-1, -1, -1);		
-	}
-    // The point we receive is in 4D homogenous coordinates
-    // so project down to 3D.
-	auto point = proj<3>(point_in);
-	Vector3d delta(point.x - screen_coords[0][0],point.y - screen_coords[0][1],point.z - screen_coords[0][2]);
-	double lambda_1 = (delta.x * vec_2.y - delta.y * vec_2.x) / determinant;
-	double lambda_2 = (-delta.x * vec_1.y + delta.y * vec_1.x) / determinant;
-	return Vector3d(1 - lambda_1 - lambda_2, lambda_1, lambda_2);
-}
-
-
 Vector3d Triangle::perspective_correct(Vector3d point) {
     // Perspective corrects a set of barycentric
     // coordinates
@@ -147,33 +180,544 @@ Vector3d Triangle::perspective_correct(Vector3d point) {
 }
 
 
-void Triangle::draw_texture(TGAImage &zbuffer, TGAImage &image, IShader& shader) {
+void Triangle::setup_edges() {
+    // Sets up the three edge functions of the triangle.
+    // Edge function i is zero along the edge opposite vertex i and
+    // grows towards vertex i; they are oriented so that all three are
+    // positive inside whatever the winding, and sum to twice the area.
+    // Dividing by that area gives the barycentric coordinates.
+    // Moving one pixel across adds a constant, so the inner loop needs
+    // no division. A pixel is covered if edge + edge_bias >= 0 for all
+    // three edges.
+#ifdef TINYRENDERER_FIXED_POINT
+    // Top-left fill rule: a pixel exactly on an edge belongs to the
+    // triangle only if that edge is a left edge (the inside lies to its
+    // right) or a top edge (horizontal with the inside below it, in the
+    // y-up image), so a pixel on an edge shared by two triangles is
+    // drawn exactly once.
+    orientation = determinant > 0 ? 1 : -1;
+    for (int i = 0; i < 3; ++i) {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        long long step_x = -(fixed_y[b] - fixed_y[a]) * SUBPIXEL_ONE * orientation;
+        long long step_y = (fixed_x[b] - fixed_x[a]) * SUBPIXEL_ONE * orientation;
+        bool top_left = step_x > 0 || (step_x == 0 && step_y < 0);
+        fixed_step_x[i] = step_x;
+        fixed_bias[i] = top_left ? 0 : -1;
+        edge_step_x[i] = static_cast<double>(fixed_step_x[i]);
+        edge_step_y[i] = static_cast<double>(step_y);
+        edge_bias[i] = static_cast<double>(fixed_bias[i]);
+    }
+#else
+    double orientation = determinant > 0 ? 1.0 : -1.0;
+    edge_step_x = Vector3d(vec_1.y - vec_2.y, vec_2.y, -vec_1.y) * orientation;
+    edge_step_y = Vector3d(vec_2.x - vec_1.x, -vec_2.x, vec_1.x) * orientation;
+    edge_bias = Vector3d(0, 0, 0);
+#endif
+    inv_area = 1.0 / std::abs(determinant);
+}
+
+
+#ifdef TINYRENDERER_FIXED_POINT
+void Triangle::fixed_edges_at(int pix_x, int pix_y, long long (&edges)[3]) {
+    // Evaluates the three edge functions exactly at (pix_x, pix_y)
+    long long point_x = pix_x * SUBPIXEL_ONE;
+    long long point_y = pix_y * SUBPIXEL_ONE;
+    for (int i = 0; i < 3; ++i) {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        edges[i] = ((fixed_x[b] - fixed_x[a]) * (point_y - fixed_y[a])
+                  - (fixed_y[b] - fixed_y[a]) * (point_x - fixed_x[a])) * orientation;
+    }
+}
+
+
+Vector3d Triangle::edges_at(int pix_x, int pix_y) {
+    // The edge values are integers well inside the 53 bits a double holds
+    // exactly, so the block path can step them as doubles without rounding
+    long long edges[3];
+    fixed_edges_at(pix_x, pix_y, edges);
+    return Vector3d(static_cast<double>(edges[0]), static_cast<double>(edges[1]), static_cast<double>(edges[2]));
+}
+#else
+Vector3d Triangle::edges_at(int pix_x, int pix_y) {
+    // Evaluates the three edge functions directly at (pix_x, pix_y)
+    double orientation = determinant > 0 ? 1.0 : -1.0;
+    double delta_x = pix_x - screen_coords[0][0];
+    double delta_y = pix_y - screen_coords[0][1];
+    double edge_1 = delta_x * vec_2.y - delta_y * vec_2.x;
+    double edge_2 = -delta_x * vec_1.y + delta_y * vec_1.x;
+    return Vector3d(determinant - edge_1 - edge_2, edge_1, edge_2) * orientation;
+}
+#endif
+
+
+template <class Shader>
+void Triangle::draw_texture(DepthBuffer &zbuffer, TGAImage &image, Shader& shader, HiZBuffer *hiz) {
+    draw_texture(zbuffer, image, shader, Vector2i(0, 0), Vector2i(image.get_width() - 1, image.get_height() - 1), hiz);
+}
+
+
+template <class Shader>
+void Triangle::draw_texture(DepthBuffer &zbuffer, TGAImage &image, Shader& shader, Vector2i clip_min, Vector2i clip_max, HiZBuffer *hiz) {
 	// Draws a triangle described by the three points t0, t1 and t2
-	// Then fills it.
-	// Proceeds by sorting t0, t1 and t2 into descenting y-order
-    for (int pix_x = bounding_min.x; pix_x <= bounding_max.x; ++pix_x){
-        for (int pix_y = bounding_min.y; pix_y <= bounding_max.y; ++pix_y){
-            auto point = Vector3i(pix_x, pix_y, 0);
-            //auto bc_screen = perspective_correct(barycentric(point));
-            auto bc_screen = barycentric(point);
-			if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0) {
-				continue;
-			}
-            
-	        double depth = screen_coords[0][2] * bc_screen.x 
-			             + screen_coords[1][2] * bc_screen.y 
-			             + screen_coords[2][2] * bc_screen.z;            
-            if (zbuffer.get(point.x, point.y).bgra[0] > depth) {
-                continue;  
+	// Then fills it, touching only pixels inside [clip_min, clip_max].
+	// Walks the bounding box in HIZ_BLOCK_SIZE blocks, and each block
+	// row by row. If a hierarchical z-buffer is given, blocks where
+	// everything stored is in front of the triangle's nearest vertex
+	// are skipped without visiting their pixels.
+	// Spans are anchored at every TILE_SIZE column, so a pixel gets
+	// exactly the same values whether it is drawn in one pass
+	// or tile by tile.
+    if (determinant == 0) {
+        // If the matrix is non-invertible, then bail out.
+        return;
+    }
+    int min_x = std::max(bounding_min.x, clip_min.x);
+    int max_x = std::min(bounding_max.x, clip_max.x);
+    int min_y = std::max(bounding_min.y, clip_min.y);
+    int max_y = std::min(bounding_max.y, clip_max.y);
+    if (min_x > max_x || min_y > max_y) {
+        return;
+    }
+    // Allow for rounding in the interpolated depth
+    double nearest_depth = std::max(screen_coords[0][2], std::max(screen_coords[1][2], screen_coords[2][2])) + 1e-6;
+
+    long blocks_visited = 0;
+    long blocks_rejected = 0;
+    long pixels_skipped = 0;
+    for (int block_y = min_y / HIZ_BLOCK_SIZE; block_y <= max_y / HIZ_BLOCK_SIZE; ++block_y) {
+        int first_y = std::max(min_y, block_y * HIZ_BLOCK_SIZE);
+        int last_y = std::min(max_y, (block_y + 1) * HIZ_BLOCK_SIZE - 1);
+        for (int block_x = min_x / HIZ_BLOCK_SIZE; block_x <= max_x / HIZ_BLOCK_SIZE; ++block_x) {
+            int first_x = std::max(min_x, block_x * HIZ_BLOCK_SIZE);
+            int last_x = std::min(max_x, (block_x + 1) * HIZ_BLOCK_SIZE - 1);
+            ++blocks_visited;
+            if (hiz && hiz->occludes(block_x, block_y, nearest_depth)) {
+                ++blocks_rejected;
+                pixels_skipped += (last_x - first_x + 1) * (last_y - first_y + 1);
+                continue;
+            }
+            int anchor_x = std::max(bounding_min.x, (first_x / TILE_SIZE) * TILE_SIZE);
+            // The edge values of the block's columns, stepped a pixel at
+            // a time along its first row from anchor_x, then a row at a
+            // time up the block
+            double edges[3][HIZ_BLOCK_SIZE];
+            Vector3d column = edges_at(anchor_x, first_y) + edge_step_x * (first_x - anchor_x);
+            for (int k = 0; k < HIZ_BLOCK_SIZE; ++k) {
+                for (int i = 0; i < 3; ++i) {
+                    edges[i][k] = column[i];
+                }
+                column = column + edge_step_x;
+            }
+            bool written = false;
+            double nearest_written = 0.0;
+            for (int pix_y = first_y; pix_y <= last_y; ++pix_y) {
+                written |= draw_span(zbuffer, image, shader, pix_y, first_x, last_x, edges, nearest_written);
+                for (int i = 0; i < 3; ++i) {
+                    for (int k = 0; k < HIZ_BLOCK_SIZE; ++k) {
+                        edges[i][k] += edge_step_y[i];
+                    }
+                }
+            }
+            if (hiz && written) {
+                hiz->record_write(block_x, block_y, nearest_written);
+            }
+        }
+    }
+    if (hiz && blocks_rejected) {
+        hiz->count_rejections(blocks_rejected, pixels_skipped, blocks_rejected == blocks_visited);
+    }
+}
+
+
+void Triangle::start_packet(FragmentPacket &packet, int pix_y) {
+    // Empties a packet for fragments of row pix_y. Barycentrics are
+    // linear in screen space, so their derivatives are constant.
+    Vector3d bar_dx = shader_barycentric(edge_step_x * inv_area);
+    Vector3d bar_dy = shader_barycentric(edge_step_y * inv_area);
+    packet.mask = 0;
+    packet.y = pix_y;
+    for (int i = 0; i < 3; ++i) {
+        packet.bar_dx[i] = bar_dx[i];
+        packet.bar_dy[i] = bar_dy[i];
+    }
+}
+
+
+void Triangle::pack_fragment(FragmentPacket &packet, int lane, int pix_x, double depth, Vector3d bc_screen) {
+    // Puts a covered pixel that passed the depth test into a lane of the packet
+    Vector3d bar = shader_barycentric(bc_screen);
+    packet.mask |= 1 << lane;
+    packet.x[lane] = pix_x;
+    packet.depth[lane] = depth;
+    for (int i = 0; i < 3; ++i) {
+        packet.bar[i][lane] = bar[i];
+    }
+}
+
+
+template <class Shader>
+bool Triangle::shade_packet(DepthBuffer &zbuffer, TGAImage &image, Shader &shader, const FragmentPacket &packet, double &nearest_written) {
+    // Shades a packet and writes the lanes the shader kept.
+    // A span never covers a pixel twice, so deferring the writes
+    // until the packet is full does not change any depth test.
+    TGAColor colors[FragmentPacket::SIZE];
+    int kept;
+    if constexpr (std::is_same<Shader, IShader>::value || has_batched_fragments<Shader>()) {
+        // Virtual for IShader, so an override is reached either way
+        kept = shader.fragments(packet, colors);
+    } else {
+        kept = shade_lanes(shader, packet, colors);
+    }
+    for (int lane = 0; lane < FragmentPacket::SIZE; ++lane) {
+        if ((kept >> lane) & 1) {
+            zbuffer.set(packet.x[lane], packet.y, packet.depth[lane]);
+            image.set(packet.x[lane], packet.y, colors[lane]);
+            nearest_written = std::max(nearest_written, packet.depth[lane]);
+        }
+    }
+    return kept != 0;
+}
+
+
+#ifdef TINYRENDERER_SIMD
+static_assert(BLOCK_WIDTH == FragmentPacket::SIZE, "a pixel block must fill one fragment packet");
+static_assert(BLOCK_WIDTH == HIZ_BLOCK_SIZE, "a span must fit one pixel block");
+
+template <class Shader>
+bool Triangle::draw_span(DepthBuffer &zbuffer, TGAImage &image, Shader& shader, int pix_y, int first_x, int last_x,
+                         const double (&edge_values)[3][HIZ_BLOCK_SIZE], double &nearest_written) {
+    // Fills pixels [first_x, last_x] of row pix_y, at most BLOCK_WIDTH
+    // of them, as one block, with edge_values[i][k] the value of edge
+    // function i at first_x + k. Returns true if any pixel was written,
+    // raising nearest_written to the largest depth written.
+    // Coverage and the depth test are evaluated for the whole block
+    // into a lane mask, and the shader only runs on lanes left in it.
+    // Lane values are computed exactly as in the scalar versions below,
+    // so all of them produce the same image.
+    PixelBlock zero = PixelBlock::broadcast(0.0);
+    PixelBlock area_scale = PixelBlock::broadcast(inv_area);
+    PixelBlock edges[3], bias[3], depth_weight[3];
+    for (int i = 0; i < 3; ++i) {
+        edges[i] = PixelBlock::load(edge_values[i]);
+        bias[i] = PixelBlock::broadcast(edge_bias[i]);
+        depth_weight[i] = PixelBlock::broadcast(screen_coords[i][2]);
+    }
+    int nlanes = last_x - first_x + 1;
+    int mask = greater_equal_mask(edges[0] + bias[0], zero) & greater_equal_mask(edges[1] + bias[1], zero)
+             & greater_equal_mask(edges[2] + bias[2], zero) & ((1 << nlanes) - 1);
+    if (!mask) {
+        return false;
+    }
+
+    PixelBlock bc[3];
+    for (int i = 0; i < 3; ++i) {
+        bc[i] = edges[i] * area_scale;
+    }
+    PixelBlock depth = depth_weight[2] * bc[2];
+    depth = depth + depth_weight[1] * bc[1];
+    depth = depth + depth_weight[0] * bc[0];
+    PixelBlock stored_depth;
+    if (nlanes == BLOCK_WIDTH) {
+        stored_depth = PixelBlock::load(zbuffer.buffer() + first_x + pix_y * zbuffer.get_width());
+    } else {
+        // Don't read past the end of the row
+        float row_end[BLOCK_WIDTH] = {};
+        for (int lane = 0; lane < nlanes; ++lane) {
+            row_end[lane] = zbuffer.get(first_x + lane, pix_y);
+        }
+        stored_depth = PixelBlock::load(row_end);
+    }
+    mask &= greater_equal_mask(depth, stored_depth);
+    if (!mask) {
+        return false;
+    }
+
+    // The block is the packet: lanes go straight from the registers
+    FragmentPacket packet;
+    start_packet(packet, pix_y);
+    packet.mask = mask;
+    depth.store(packet.depth);
+    for (int lane = 0; lane < BLOCK_WIDTH; ++lane) {
+        packet.x[lane] = first_x + lane;
+    }
+    if (clipped) {
+        double bc_lanes[3][BLOCK_WIDTH];
+        for (int i = 0; i < 3; ++i) {
+            bc[i].store(bc_lanes[i]);
+        }
+        for (int lane = 0; lane < BLOCK_WIDTH; ++lane) {
+            Vector3d bc_screen(bc_lanes[0][lane], bc_lanes[1][lane], bc_lanes[2][lane]);
+            pack_fragment(packet, lane, packet.x[lane], packet.depth[lane], bc_screen);
+        }
+        packet.mask = mask;
+    } else {
+        for (int i = 0; i < 3; ++i) {
+            bc[i].store(packet.bar[i]);
+        }
+    }
+    return shade_packet(zbuffer, image, shader, packet, nearest_written);
+}
+#elif defined(TINYRENDERER_FIXED_POINT)
+template <class Shader>
+bool Triangle::draw_span(DepthBuffer &zbuffer, TGAImage &image, Shader& shader, int pix_y, int first_x, int last_x,
+                         const double (&edge_values)[3][HIZ_BLOCK_SIZE], double &nearest_written) {
+    // Fills pixels [first_x, last_x] of row pix_y, testing them one
+    // at a time and shading those that pass a packet at a time,
+    // stepping the integer edge functions exactly from their values
+    // at first_x, edge_values[i][0]. Returns true if any pixel was
+    // written, raising nearest_written to the largest depth written.
+    long long edges[3];
+    for (int i = 0; i < 3; ++i) {
+        edges[i] = static_cast<long long>(edge_values[i][0]);
+    }
+    Vector3d depths(screen_coords[0][2], screen_coords[1][2], screen_coords[2][2]);
+    bool written = false;
+    FragmentPacket packet;
+    start_packet(packet, pix_y);
+    int lanes = 0;
+    for (int pix_x = first_x; pix_x <= last_x; ++pix_x){
+        // The sign bit of the OR is set if any biased edge is negative
+        bool covered = ((edges[0] + fixed_bias[0]) | (edges[1] + fixed_bias[1]) | (edges[2] + fixed_bias[2])) >= 0;
+        if (covered) {
+            Vector3d bc_screen = Vector3d(static_cast<double>(edges[0]), static_cast<double>(edges[1]),
+                                          static_cast<double>(edges[2])) * inv_area;
+            double depth = depths * bc_screen;
+            if (zbuffer.test(pix_x, pix_y, depth)) {
+                pack_fragment(packet, lanes++, pix_x, depth, bc_screen);
+            }
+        }
+        if (lanes == FragmentPacket::SIZE || (pix_x == last_x && lanes)) {
+            for (; lanes < FragmentPacket::SIZE; ++lanes) {
+                pack_fragment(packet, lanes, pix_x, 0.0, Vector3d(0, 0, 0));
+                packet.mask &= ~(1 << lanes);
             }
-            TGAColor color;
-            bool discard = shader.fragment(bc_screen, color);
-			if (!discard) {		
-                zbuffer.set(point.x, point.y, TGAColor(depth));
-				image.set(pix_x, pix_y, color);
-			}
+            written |= shade_packet(zbuffer, image, shader, packet, nearest_written);
+            packet.mask = 0;
+            lanes = 0;
+        }
+        for (int i = 0; i < 3; ++i) {
+            edges[i] += fixed_step_x[i];
         }
     }
+    return written;
+}
+#else
+template <class Shader>
+bool Triangle::draw_span(DepthBuffer &zbuffer, TGAImage &image, Shader& shader, int pix_y, int first_x, int last_x,
+                         const double (&edge_values)[3][HIZ_BLOCK_SIZE], double &nearest_written) {
+    // Fills pixels [first_x, last_x] of row pix_y, testing them one
+    // at a time and shading those that pass a packet at a time, with
+    // edge_values[i][k] the value of edge function i at first_x + k.
+    // Returns true if any pixel was written, raising nearest_written
+    // to the largest depth written.
+    Vector3d depths(screen_coords[0][2], screen_coords[1][2], screen_coords[2][2]);
+    bool written = false;
+    FragmentPacket packet;
+    start_packet(packet, pix_y);
+    int lanes = 0;
+    for (int pix_x = first_x; pix_x <= last_x; ++pix_x){
+        int k = pix_x - first_x;
+        Vector3d edges(edge_values[0][k], edge_values[1][k], edge_values[2][k]);
+        if (edges.x + edge_bias.x >= 0 && edges.y + edge_bias.y >= 0 && edges.z + edge_bias.z >= 0) {
+            Vector3d bc_screen = edges * inv_area;
+            double depth = depths * bc_screen;
+            if (zbuffer.test(pix_x, pix_y, depth)) {
+                pack_fragment(packet, lanes++, pix_x, depth, bc_screen);
+            }
+        }
+        if (lanes == FragmentPacket::SIZE || (pix_x == last_x && lanes)) {
+            for (; lanes < FragmentPacket::SIZE; ++lanes) {
+                pack_fragment(packet, lanes, pix_x, 0.0, Vector3d(0, 0, 0));
+                packet.mask &= ~(1 << lanes);
+            }
+            written |= shade_packet(zbuffer, image, shader, packet, nearest_written);
+            packet.mask = 0;
+            lanes = 0;
+        }
+    }
+    return written;
+}
+#endif
+
+
+#define INSTANTIATE_DRAW_TEXTURE(Shader) \
+    template void Triangle::draw_texture<Shader>(DepthBuffer&, TGAImage&, Shader&, HiZBuffer*); \
+    template void Triangle::draw_texture<Shader>(DepthBuffer&, TGAImage&, Shader&, Vector2i, Vector2i, HiZBuffer*);
+
+INSTANTIATE_DRAW_TEXTURE(IShader)
+INSTANTIATE_DRAW_TEXTURE(GouraudShader)
+INSTANTIATE_DRAW_TEXTURE(TextureShader)
+INSTANTIATE_DRAW_TEXTURE(PhongShader)
+INSTANTIATE_DRAW_TEXTURE(ShadowShader)
+INSTANTIATE_DRAW_TEXTURE(GBufferShader)
+INSTANTIATE_DRAW_TEXTURE(SSAOShader)
+INSTANTIATE_DRAW_TEXTURE(DepthShader)
+INSTANTIATE_DRAW_TEXTURE(EmptyShader)
+#undef INSTANTIATE_DRAW_TEXTURE
+
+
+namespace {
+
+struct ClipVertex {
+    Vector4d position;
+    Vector3d barycentric;
+};
+
+int clip_polygon(const ClipVertex *in, int nin, ClipVertex *out, Vector4d plane) {
+    // Clips a convex polygon against the half-space plane * position >= 0
+    // (Sutherland-Hodgman), interpolating positions and barycentrics
+    // linearly in homogeneous space. Returns the new vertex count.
+    int nout = 0;
+    for (int i = 0; i < nin; ++i) {
+        const ClipVertex &current = in[i];
+        const ClipVertex &next = in[(i + 1) % nin];
+        double d_current = plane * current.position;
+        double d_next = plane * next.position;
+        if (d_current >= 0) {
+            out[nout++] = current;
+        }
+        if ((d_current >= 0) != (d_next >= 0)) {
+            double t = d_current / (d_current - d_next);
+            out[nout].position = current.position + (next.position - current.position) * t;
+            out[nout].barycentric = current.barycentric + (next.barycentric - current.barycentric) * t;
+            ++nout;
+        }
+    }
+    return nout;
+}
+
+}
+
+
+int assemble_triangle(const Vector4d (&vertices)[3], TGAImage &image, CullMode cull,
+                      Triangle (&out)[2], PrimitiveStats *stats) {
+    // Primitive assembly: turns the three vertex shader outputs of a face
+    // into at most two triangles ready for rasterization.
+    // The vertices already have the viewport applied, so the view volume
+    // in homogeneous coordinates is 0 <= x <= width*w, 0 <= y <= height*w,
+    // 0 <= z <= MAX_DEPTH*w.
+    // - back faces (as chosen by cull) and zero-area faces are culled;
+    // - faces wholly outside one side of the view volume are rejected;
+    // - faces crossing the near plane (z = MAX_DEPTH*w) are clipped.
+    // The rasterizer clamps to the screen and fragments beyond the far
+    // plane fail the depth test, so the other planes only ever reject.
+    // Clipping at the near plane also keeps w > 0 for everything that
+    // can pass the depth test.
+    // Returns the number of triangles written to out.
+    double area = (vertices[1][0] - vertices[0][0]) * (vertices[2][1] - vertices[0][1])
+                - (vertices[1][1] - vertices[0][1]) * (vertices[2][0] - vertices[0][0]);
+    if (area == 0 || (cull == CULL_CW && area < 0) || (cull == CULL_CCW && area > 0)) {
+        if (stats) ++stats->culled;
+        return 0;
+    }
+
+    const int NPLANES = 6;
+    const Vector4d planes[NPLANES] = {
+        embed<4>(Vector3d(1, 0, 0), 0.0),                    // left
+        embed<4>(Vector3d(-1, 0, 0), 1.0 * image.get_width()),  // right
+        embed<4>(Vector3d(0, 1, 0), 0.0),                    // bottom
+        embed<4>(Vector3d(0, -1, 0), 1.0 * image.get_height()), // top
+        embed<4>(Vector3d(0, 0, 1), 0.0),                    // far
+        embed<4>(Vector3d(0, 0, -1), 1.0 * MAX_DEPTH),          // near
+    };
+    const int NEAR_PLANE = 5;
+    int outside_near = 0;
+    for (int p = 0; p < NPLANES; ++p) {
+        int outside = 0;
+        for (int j = 0; j < 3; ++j) {
+            outside += planes[p] * vertices[j] < 0;
+        }
+        if (outside == 3) {
+            if (stats) ++stats->rejected;
+            return 0;
+        }
+        if (p == NEAR_PLANE) {
+            outside_near = outside;
+        }
+    }
+    if (!outside_near) {
+        out[0] = Triangle(vertices[0], vertices[1], vertices[2], image);
+        return 1;
+    }
+
+    ClipVertex triangle[3];
+    for (int j = 0; j < 3; ++j) {
+        triangle[j].position = vertices[j];
+        triangle[j].barycentric = Vector3d(j == 0, j == 1, j == 2);
+    }
+    ClipVertex polygon[4];
+    int nvertices = clip_polygon(triangle, 3, polygon, planes[NEAR_PLANE]);
+    if (stats) ++stats->clipped;
+
+    // One vertex outside leaves a quad, two leave a triangle
+    int ntriangles = nvertices - 2;
+    for (int k = 0; k < ntriangles; ++k) {
+        const ClipVertex &v0 = polygon[0];
+        const ClipVertex &v1 = polygon[k + 1];
+        const ClipVertex &v2 = polygon[k + 2];
+        out[k] = Triangle(v0.position, v1.position, v2.position, image);
+        mat<3, 3, double> to_parent;
+        to_parent.set_col(0, v0.barycentric);
+        to_parent.set_col(1, v1.barycentric);
+        to_parent.set_col(2, v2.barycentric);
+        out[k].set_parent(to_parent);
+    }
+    return ntriangles;
+}
+
+
+std::vector<Vector4r> transform_vertices(Model &model, const Matrixr &transform) {
+    // Transforms every vertex of the model once into a buffer for
+    // IShader::vertex_buffer, so faces sharing a vertex share the work.
+    // transform is the full viewport * projection * modelview product,
+    // computed once per draw rather than once per corner.
+    std::vector<Vector4r> transformed(model.nverts());
+    const int batch = 1024;
+    render_pool().parallel_for((model.nverts() + batch - 1) / batch, [&](int task, int) {
+        for (int i = task * batch; i < std::min(model.nverts(), (task + 1) * batch); ++i) {
+            transformed[i] = transform * embed<4>(model.vert(i));
+        }
+    });
+    return transformed;
+}
+
+
+TileBins::TileBins(int width, int height) : tiles_x((width + TILE_SIZE - 1) / TILE_SIZE),
+                                            tiles_y((height + TILE_SIZE - 1) / TILE_SIZE),
+                                            bins(tiles_x * tiles_y) {
+}
+
+void TileBins::insert(int face, const Triangle &triangle) {
+    // Adds the face to the bin of every tile its bounding box overlaps.
+    // Faces must be inserted in draw order, so each bin keeps it.
+    if (!triangle.is_drawable()) {
+        return;
+    }
+    Vector2i bounding_min = triangle.get_bounding_min();
+    Vector2i bounding_max = triangle.get_bounding_max();
+    for (int tile_y = bounding_min.y / TILE_SIZE; tile_y <= bounding_max.y / TILE_SIZE; ++tile_y) {
+        for (int tile_x = bounding_min.x / TILE_SIZE; tile_x <= bounding_max.x / TILE_SIZE; ++tile_x) {
+            bins[tile_x + tile_y * tiles_x].push_back(face);
+        }
+    }
+}
+
+int TileBins::ntiles() const {
+    return static_cast<int>(bins.size());
+}
+
+const std::vector<int>& TileBins::bin(int tile) const {
+    return bins[tile];
+}
+
+Vector2i TileBins::tile_min(int tile) const {
+    return Vector2i((tile % tiles_x) * TILE_SIZE, (tile / tiles_x) * TILE_SIZE);
+}
+
+Vector2i TileBins::tile_max(int tile) const {
+    return tile_min(tile) + Vector2i(TILE_SIZE - 1, TILE_SIZE - 1);
 }
 
 
@@ -1,5 +1,6 @@
 #include <vector>
 #include <cmath>
+#include <algorithm>
 
 #include "geometry.h"
 #include "shaders.h"
@@ -8,8 +9,8 @@
 
 IShader::~IShader() {}
 
-mat<3, 3, double> rotation_x(double theta) {
-    mat<3, 3, double> mat;
+mat<3, 3, real> rotation_x(double theta) {
+    mat<3, 3, real> mat;
     mat[0][0] = 1.0;
     mat[0][1] = 0;
     mat[0][2] = 0.0;
@@ -25,8 +26,8 @@ mat<3, 3, double> rotation_x(double theta) {
     return mat;
 }
 
-mat<3, 3, double> rotation_y(double theta) {
-    mat<3, 3, double> mat;
+mat<3, 3, real> rotation_y(double theta) {
+    mat<3, 3, real> mat;
     mat[0][0] = cos(theta);
     mat[0][1] = 0;
     mat[0][2] = sin(theta);
@@ -42,8 +43,8 @@ mat<3, 3, double> rotation_y(double theta) {
     return mat;
 }
 
-mat<3, 3, double> rotation_z(double theta) {
-    mat<3, 3, double> mat;
+mat<3, 3, real> rotation_z(double theta) {
+    mat<3, 3, real> mat;
     mat[0][0] = cos(theta);
     mat[0][1] = -sin(theta);
     mat[0][2] = 0.0;
@@ -57,4 +58,66 @@ mat<3, 3, double> rotation_z(double theta) {
     mat[2][2] = 1.0;
     
     return mat;
-}
\ No newline at end of file
+}
+
+void light_packet(Model *model, const Matrixr &uniform_M, const Matrixr &uniform_MIT, const FragmentPacket &packet,
+                  const real (&uv)[2][FragmentPacket::SIZE], real uv_lod, double (&diffuse)[FragmentPacket::SIZE],
+                  double (&specular)[FragmentPacket::SIZE]) {
+    // The diffuse and specular terms of PhongShader and ShadowShader
+    // for a whole packet. Texture fetches and pow go lane by lane; the
+    // normal transform and lighting vectors run across all lanes, with
+    // every sum in the same order as the per-fragment version.
+    const int N = FragmentPacket::SIZE;
+    real normal[3][N];
+    double exponent[N];
+    for (int lane = 0; lane < N; ++lane) {
+        Vector3r n(0, 0, 1);
+        exponent[lane] = 0;
+        if ((packet.mask >> lane) & 1) {
+            Vector2r lane_uv(uv[0][lane], uv[1][lane]);
+            n = model->normalmap(lane_uv, uv_lod);
+            exponent[lane] = model->specularmap(lane_uv, uv_lod);
+        }
+        normal[0][lane] = n.x;
+        normal[1][lane] = n.y;
+        normal[2][lane] = n.z;
+    }
+
+    // norm_vec = proj<3>(uniform_MIT * embed<4>(normal)).normalize()
+    real norm_vec[3][N];
+    for (int row = 0; row < 3; ++row) {
+        const Vector4r &m = uniform_MIT[row];
+        for (int lane = 0; lane < N; ++lane) {
+            norm_vec[row][lane] = m[3] + m[2] * normal[2][lane] + m[1] * normal[1][lane] + m[0] * normal[0][lane];
+        }
+    }
+    for (int lane = 0; lane < N; ++lane) {
+        real x = norm_vec[0][lane];
+        real y = norm_vec[1][lane];
+        real z = norm_vec[2][lane];
+        double scale = 1.0 / std::sqrt(x*x + y*y + z*z);
+        norm_vec[0][lane] = x * scale;
+        norm_vec[1][lane] = y * scale;
+        norm_vec[2][lane] = z * scale;
+    }
+
+    // The light is the same for every lane
+    Vector3r light_in = proj<3>(uniform_M * embed<4>(g_LIGHT_DIRECTION)).normalize();
+    double reflected[N];
+    for (int lane = 0; lane < N; ++lane) {
+        real facing = light_in[2] * norm_vec[2][lane] + light_in[1] * norm_vec[1][lane] + light_in[0] * norm_vec[0][lane];
+        double twice_facing = facing * 2.0;
+        real x = static_cast<real>(light_in.x * twice_facing) - light_in.x;
+        real y = static_cast<real>(light_in.y * twice_facing) - light_in.y;
+        real z = static_cast<real>(light_in.z * twice_facing) - light_in.z;
+        double scale = 1.0 / std::sqrt(x*x + y*y + z*z);
+        x *= scale;
+        y *= scale;
+        z *= scale;
+        diffuse[lane] = std::max(0.0, facing * -1.0);
+        reflected[lane] = std::max((z * g_LIGHT_DIRECTION.z + y * g_LIGHT_DIRECTION.y + x * g_LIGHT_DIRECTION.x) * -1.0, 0.0);
+    }
+    for (int lane = 0; lane < N; ++lane) {
+        specular[lane] = (packet.mask >> lane) & 1 ? pow(reflected[lane], exponent[lane]) : 0.0;
+    }
+}
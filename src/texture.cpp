@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "texture.h"
+#include "tgaimage.h"
+
+Texture::Texture() : levels(), mapping(), bytespp(0), layout(LINEAR), log2_size(0) {
+}
+
+Texture::Texture(TGAImage &image, Layout layout) : levels(), mapping(), bytespp(image.get_bytespp()), layout(layout), log2_size(0) {
+    int width = image.get_width();
+    int height = image.get_height();
+    if (!image.row(0) || width <= 0 || height <= 0) {
+        return;
+    }
+    log2_size = std::log2(static_cast<real>(std::max(width, height)));
+    long row_stride = image.get_row_stride();
+    if (layout == LINEAR && image.is_mapped() && row_stride % bytespp == 0) {
+        mapping = image.get_mapping();
+        levels.push_back({width, height, 0, {}, static_cast<int>(row_stride / bytespp), image.row(0)});
+    } else {
+        Level level{width, height, 0, std::vector<unsigned char>(width*height*bytespp), width, nullptr};
+        for (int y = 0; y < height; ++y) {
+            std::copy_n(image.row(y), width*bytespp, &level.texels[y*width*bytespp]);
+        }
+        levels.push_back(std::move(level));
+    }
+    while (width > 1 || height > 1) {
+        // Averages each 2x2 block of the level above; an odd last
+        // row or column is folded into the block before it
+        const Level &above = levels.back();
+        const unsigned char *texels = above.pixels();
+        Level level{std::max(1, width / 2), std::max(1, height / 2), 0, {}, 0, nullptr};
+        level.stride = level.width;
+        level.texels.resize(level.width * level.height * bytespp);
+        for (int y = 0; y < level.height; ++y) {
+            int y0 = std::min(2*y, height - 1);
+            int y1 = std::min(2*y + 1, height - 1);
+            for (int x = 0; x < level.width; ++x) {
+                int x0 = std::min(2*x, width - 1);
+                int x1 = std::min(2*x + 1, width - 1);
+                for (int c = 0; c < bytespp; ++c) {
+                    int sum = texels[texel_index<LINEAR>(above, x0, y0)*bytespp + c] + texels[texel_index<LINEAR>(above, x1, y0)*bytespp + c]
+                            + texels[texel_index<LINEAR>(above, x0, y1)*bytespp + c] + texels[texel_index<LINEAR>(above, x1, y1)*bytespp + c];
+                    level.texels[(x + y*level.width)*bytespp + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        width = level.width;
+        height = level.height;
+        levels.push_back(std::move(level));
+    }
+
+    if (layout == TILED) {
+        // The pyramid is built row-major, then each level is reordered
+        for (Level &level : levels) {
+            level.tiles_x = (level.width + TILE - 1) / TILE;
+            int tiles_y = (level.height + TILE - 1) / TILE;
+            std::vector<unsigned char> tiled(level.tiles_x * tiles_y * TILE * TILE * bytespp);
+            for (int y = 0; y < level.height; ++y) {
+                for (int x = 0; x < level.width; ++x) {
+                    std::copy_n(&level.texels[texel_index<LINEAR>(level, x, y) * bytespp], bytespp,
+                                &tiled[texel_index<TILED>(level, x, y) * bytespp]);
+                }
+            }
+            level.texels.swap(tiled);
+        }
+    }
+}
+
+std::size_t Texture::memory_size() const {
+    std::size_t bytes = 0;
+    for (const Level &level : levels) {
+        // A borrowed level is in the page cache, not ours
+        bytes += level.texels.size();
+    }
+    return bytes;
+}
+
+TGAColor Texture::get(int x, int y, int level) const {
+    const Level &source = levels[level];
+    int index = layout == TILED ? texel_index<TILED>(source, x, y) : texel_index<LINEAR>(source, x, y);
+    return TGAColor(source.pixels() + index * bytespp, static_cast<unsigned char>(bytespp));
+}
+
+template <int Channels>
+static void blend_texels(const unsigned char *t00, const unsigned char *t10, const unsigned char *t01,
+                         const unsigned char *t11, int wx, int wy, int (&out)[4]) {
+    // Weights are in 1/256ths, so out is in 1/65536ths of a channel step
+    for (int c = 0; c < Channels; ++c) {
+        int top = t00[c] * (256 - wx) + t10[c] * wx;
+        int bottom = t01[c] * (256 - wx) + t11[c] * wx;
+        out[c] = top * (256 - wy) + bottom * wy;
+    }
+}
+
+template <Texture::Layout L, int Channels>
+void Texture::bilinear(const Level &level, Vector2r uv, int (&out)[4]) const {
+    // Blends the four texels around uv, with texel centres at half
+    // integer coordinates
+    real x = uv[0] * level.width - real(0.5);
+    real y = uv[1] * level.height - real(0.5);
+    real floor_x = std::floor(x);
+    real floor_y = std::floor(y);
+    int wx = static_cast<int>((x - floor_x) * 256);
+    int wy = static_cast<int>((y - floor_y) * 256);
+    int x0 = std::min(std::max(static_cast<int>(floor_x), 0), level.width - 1);
+    int y0 = std::min(std::max(static_cast<int>(floor_y), 0), level.height - 1);
+    int x1 = std::min(std::max(static_cast<int>(floor_x) + 1, 0), level.width - 1);
+    int y1 = std::min(std::max(static_cast<int>(floor_y) + 1, 0), level.height - 1);
+    const unsigned char *texels = level.pixels();
+    blend_texels<Channels>(texels + texel_index<L>(level, x0, y0) * Channels, texels + texel_index<L>(level, x1, y0) * Channels,
+                           texels + texel_index<L>(level, x0, y1) * Channels, texels + texel_index<L>(level, x1, y1) * Channels,
+                           wx, wy, out);
+}
+
+template <Texture::Layout L, int Channels>
+void Texture::filter(Vector2r uv, real uv_lod, int (&out)[4]) const {
+    real lod = uv_lod + log2_size;
+    int last = nlevels() - 1;
+    if (!(lod > 0)) {
+        bilinear<L, Channels>(levels[0], uv, out);
+    } else if (lod >= last) {
+        bilinear<L, Channels>(levels[last], uv, out);
+    } else {
+        int level = static_cast<int>(lod);
+        int weight = static_cast<int>((lod - level) * 256);
+        int coarser[4] = {};
+        bilinear<L, Channels>(levels[level], uv, out);
+        bilinear<L, Channels>(levels[level + 1], uv, coarser);
+        // Texels are 16.16 fixed point, so the product needs 64 bits
+        for (int c = 0; c < Channels; ++c) {
+            out[c] += static_cast<int>(static_cast<std::int64_t>(coarser[c] - out[c]) * weight >> 8);
+        }
+    }
+}
+
+template <Texture::Layout L>
+void Texture::filter(Vector2r uv, real uv_lod, int (&out)[4]) const {
+    // A fixed channel count lets the compiler unroll the blends
+    switch (bytespp) {
+        case TGAImage::GRAYSCALE: filter<L, 1>(uv, uv_lod, out); break;
+        case TGAImage::RGB:       filter<L, 3>(uv, uv_lod, out); break;
+        default:                  filter<L, 4>(uv, uv_lod, out); break;
+    }
+}
+
+TGAColor Texture::sample(Vector2r uv, real uv_lod) const {
+    if (levels.empty()) {
+        return {0,0,0,255};
+    }
+    int texel[4] = {};
+    if (layout == TILED) {
+        filter<TILED>(uv, uv_lod, texel);
+    } else {
+        filter<LINEAR>(uv, uv_lod, texel);
+    }
+    unsigned char bytes[4];
+    for (int c = 0; c < bytespp; ++c) {
+        bytes[c] = static_cast<unsigned char>((texel[c] + 32768) >> 16);
+    }
+    return TGAColor(bytes, static_cast<unsigned char>(bytespp));
+}
@@ -3,7 +3,9 @@
 #include <cstring>
 #include <ctime>
 #include <cmath>
+#include <algorithm>
 #include "tgaimage.h"
+#include "mapped_file.h"
 
 TGAImage::TGAImage() = default;
 
@@ -13,12 +15,22 @@ TGAImage::TGAImage(int w, int h, int bpp) : data(nullptr), width(w), height(h),
     memset(data, 0, nbytes);
 }
 
-TGAImage::TGAImage(const TGAImage &img) : data(nullptr), width(img.width), height(img.height), bytespp(img.bytespp) {
+TGAImage::TGAImage(const TGAImage &img) : data(nullptr), width(img.width), height(img.height), bytespp(img.bytespp),
+        mapping(img.mapping), pixels(img.pixels), row_stride(img.row_stride) {
+    // Mapped images share their mapping instead of copying it
+    if (mapping) return;
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
     memcpy(data, img.data, nbytes);
 }
 
+TGAImage::TGAImage(TGAImage &&img) noexcept : data(img.data), width(img.width), height(img.height), bytespp(img.bytespp),
+        mapping(std::move(img.mapping)), pixels(img.pixels), row_stride(img.row_stride) {
+    img.data = nullptr;
+    img.pixels = nullptr;
+    img.width = img.height = img.bytespp = 0;
+}
+
 TGAImage::~TGAImage() {
     if (data) delete [] data;
 }
@@ -26,122 +38,222 @@ TGAImage::~TGAImage() {
 TGAImage & TGAImage::operator =(const TGAImage &img) {
     if (this != &img) {
         if (data) delete [] data;
+        data = nullptr;
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
-        unsigned long nbytes = width*height*bytespp;
-        data = new unsigned char[nbytes];
-        memcpy(data, img.data, nbytes);
+        mapping = img.mapping;
+        pixels = img.pixels;
+        row_stride = img.row_stride;
+        if (!mapping) {
+            unsigned long nbytes = width*height*bytespp;
+            data = new unsigned char[nbytes];
+            memcpy(data, img.data, nbytes);
+        }
+    }
+    return *this;
+}
+
+TGAImage & TGAImage::operator =(TGAImage &&img) noexcept {
+    if (this != &img) {
+        if (data) delete [] data;
+        data = img.data;
+        width = img.width;
+        height = img.height;
+        bytespp = img.bytespp;
+        mapping = std::move(img.mapping);
+        pixels = img.pixels;
+        row_stride = img.row_stride;
+        img.data = nullptr;
+        img.pixels = nullptr;
+        img.width = img.height = img.bytespp = 0;
     }
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char *filename) {
+void TGAImage::make_writable() {
+    // Copies a mapped image into memory of its own, rows in order
+    if (!mapping) return;
+    unsigned long rowbytes = width*bytespp;
+    data = new unsigned char[rowbytes*height];
+    for (int y=0; y<height; y++) {
+        memcpy(data + y*rowbytes, row(y), rowbytes);
+    }
+    mapping.reset();
+    pixels = nullptr;
+    row_stride = 0;
+}
+
+const unsigned char *TGAImage::row(int y) const {
+    if (mapping) {
+        return pixels + y*row_stride;
+    }
+    return data ? data + static_cast<long>(y)*width*bytespp : nullptr;
+}
+
+bool TGAImage::read_tga_file(const char *filename, bool bottom_up) {
+    // Maps the whole file and decodes it from memory
     if (data) delete [] data;
     data = nullptr;
-    std::ifstream in;
-    in.open (filename, std::ios::binary);
-    if (!in.is_open()) {
+    mapping.reset();
+    pixels = nullptr;
+    MappedFile file(filename);
+    if (!file.data()) {
         std::cerr << "can't open file " << filename << "\n";
-        in.close();
         return false;
     }
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(file.data());
+    const unsigned char *end = in + file.size();
     TGA_Header header;
-    in.read((char *)&header, sizeof(header));
-    if (!in.good()) {
-        in.close();
+    if (file.size() < sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    memcpy(&header, in, sizeof(header));
+    in += sizeof(header) + static_cast<unsigned char>(header.idlength);
     width   = header.width;
     height  = header.height;
     bytespp = header.bitsperpixel>>3;
     if (width<=0 || height<=0 || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    unsigned long nbytes = bytespp*width*height;
+    unsigned long rowbytes = bytespp*width;
+    unsigned long nbytes = rowbytes*height;
     data = new unsigned char[nbytes];
+    // The file's rows run bottom to top unless its origin is at the top
+    bool flip = !(header.imagedescriptor & 0x20) != bottom_up;
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read((char *)data, nbytes);
-        if (!in.good()) {
-            in.close();
+        if (in > end || static_cast<unsigned long>(end - in) < nbytes) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        if (flip) {
+            for (int y=height-1; y>=0; y--, in += rowbytes) {
+                memcpy(data + y*rowbytes, in, rowbytes);
+            }
+        } else {
+            memcpy(data, in, nbytes);
+        }
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
+        if (in > end || !load_rle_data(in, end, flip)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     } else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
-    }
     if (header.imagedescriptor & 0x10) {
         flip_horizontally();
     }
     //std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
-    in.close();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    unsigned long pixelcount = width*height;
-    unsigned long currentpixel = 0;
-    unsigned long currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+bool TGAImage::map_tga_file(const char *filename, bool bottom_up) {
+    auto file = std::make_shared<MappedFile>(filename, MappedFile::RANDOM);
+    TGA_Header header;
+    if (!file->data() || file->size() < sizeof(header)) {
+        return read_tga_file(filename, bottom_up);
+    }
+    memcpy(&header, file->data(), sizeof(header));
+    int bpp = header.bitsperpixel>>3;
+    unsigned long rowbytes = static_cast<unsigned long>(header.width)*bpp;
+    unsigned long payload = sizeof(header) + static_cast<unsigned char>(header.idlength);
+    if ((2!=header.datatypecode && 3!=header.datatypecode) || (header.imagedescriptor & 0x10)
+        || header.width<=0 || header.height<=0 || (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA)
+        || file->size() < payload || file->size() - payload < rowbytes*header.height) {
+        // Compressed, mirrored or malformed; read_tga_file decodes or reports it
+        return read_tga_file(filename, bottom_up);
+    }
+    if (data) delete [] data;
+    data = nullptr;
+    width = header.width;
+    height = header.height;
+    bytespp = bpp;
+    // Rows are never moved: reading them in the other order is a
+    // negative stride from the last one
+    const unsigned char *first = reinterpret_cast<const unsigned char *>(file->data()) + payload;
+    if (!(header.imagedescriptor & 0x20) == bottom_up) {
+        pixels = first;
+        row_stride = static_cast<long>(rowbytes);
+    } else {
+        pixels = first + (height-1)*rowbytes;
+        row_stride = -static_cast<long>(rowbytes);
+    }
+    mapping = std::move(file);
+    return true;
+}
+
+bool TGAImage::load_rle_data(const unsigned char *in, const unsigned char *end, bool flip) {
+    // Each packet is a header byte and then either 1 to 128 literal
+    // pixels, copied with memcpy, or one pixel repeated 1 to 128 times.
+    // Packets may cross rows, so each is split at row ends and the
+    // next row is the one after in storage order, upwards when flipping.
+    long rowbytes = static_cast<long>(width)*bytespp;
+    unsigned char *row = flip ? data + (height-1)*rowbytes : data;
+    long rowstep = flip ? -rowbytes : rowbytes;
+    int rows_left = height;
+    int column = 0;
+    while (rows_left > 0) {
+        if (in >= end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read((char *)colorbuffer.bgra, bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.bgra, bytespp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
+        unsigned char chunkheader = *in++;
+        bool repeated = chunkheader >= 128;
+        int count = (chunkheader & 127) + 1;
+        long packetbytes = repeated ? bytespp : static_cast<long>(count)*bytespp;
+        if (end - in < packetbytes) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+        while (count > 0) {
+            if (rows_left == 0) {
+                std::cerr << "Too many pixels read\n";
                 return false;
             }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
+            int span = std::min(count, width - column);
+            unsigned char *out = row + column*bytespp;
+            if (!repeated) {
+                memcpy(out, in, static_cast<size_t>(span)*bytespp);
+                in += span*bytespp;
+            } else if (bytespp == 1) {
+                memset(out, *in, span);
+            } else {
+                // Copy one pixel, then keep doubling the copied part
+                memcpy(out, in, bytespp);
+                long filled = bytespp, total = static_cast<long>(span)*bytespp;
+                while (filled < total) {
+                    long chunk = std::min(filled, total - filled);
+                    memcpy(out + filled, out, chunk);
+                    filled += chunk;
                 }
             }
+            count -= span;
+            column += span;
+            if (column == width) {
+                column = 0;
+                row += rowstep;
+                rows_left--;
+            }
         }
-    } while (currentpixel < pixelcount);
+        if (repeated) {
+            in += bytespp;
+        }
+    }
     return true;
 }
 
-bool TGAImage::write_tga_file(const char *filename, bool rle) {
+bool TGAImage::write_tga_file(const char *filename, bool rle, bool bottom_up) {
+    std::vector<std::vector<unsigned char>> parts(1);
+    encode_rows(0, height, rle, parts[0]);
+    return write_encoded(filename, rle, bottom_up, parts);
+}
+
+bool TGAImage::write_encoded(const char *filename, bool rle, bool bottom_up,
+                             const std::vector<std::vector<unsigned char>> &parts) const {
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
     unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
@@ -158,39 +270,18 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     header.width  = width;
     header.height = height;
     header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.imagedescriptor = bottom_up ? 0x00 : 0x20; // bottom-left or top-left origin
     out.write((char *)&header, sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    if (!rle) {
-        out.write((char *)data, width*height*bytespp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            out.close();
-            return false;
-        }
-    } else {
-        if (!unload_rle_data(out)) {
-            out.close();
-            std::cerr << "can't unload rle data\n";
-            return false;
-        }
+    for (const std::vector<unsigned char> &part : parts) {
+        out.write((const char *)part.data(), part.size());
     }
-    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
         out.close();
         return false;
     }
+    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
     out.write((char *)extension_area_ref, sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
-    }
     out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
@@ -201,50 +292,47 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
-    const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width*height;
-    unsigned long curpix = 0;
-    while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
-        unsigned char run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
-            if (1==run_length) {
-                raw = !succ_eq;
+void TGAImage::encode_rows(int first, int last, bool rle, std::vector<unsigned char> &out) const {
+    unsigned long rowbytes = width*bytespp;
+    if (!rle) {
+        for (int y=first; y<last; y++) {
+            out.insert(out.end(), row(y), row(y) + rowbytes);
+        }
+        return;
+    }
+    // A run packet repeats one pixel up to 128 times; a raw packet
+    // holds up to 128 pixels and ends where a run of two could start
+    const int max_chunk_length = 128;
+    for (int y=first; y<last; y++) {
+        const unsigned char *line = row(y);
+        auto same = [&](int x1, int x2) { return memcmp(line + x1*bytespp, line + x2*bytespp, bytespp) == 0; };
+        int x = 0;
+        while (x < width) {
+            int run = 1;
+            while (x+run < width && run < max_chunk_length && same(x+run, x)) {
+                run++;
             }
-            if (raw && succ_eq) {
-                run_length--;
-                break;
+            if (run > 1) {
+                out.push_back(static_cast<unsigned char>(run+127));
+                out.insert(out.end(), line + x*bytespp, line + (x+1)*bytespp);
+                x += run;
+                continue;
             }
-            if (!raw && !succ_eq) {
-                break;
+            int count = 1;
+            while (x+count < width && count < max_chunk_length && !(x+count+1 < width && same(x+count, x+count+1))) {
+                count++;
             }
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+            out.push_back(static_cast<unsigned char>(count-1));
+            out.insert(out.end(), line + x*bytespp, line + (x+count)*bytespp);
+            x += count;
         }
     }
-    return true;
 }
 
 TGAColor TGAImage::get(int i) {
+    if (mapping) {
+        return TGAColor(row(i/width)+(i%width)*bytespp, bytespp);
+    }
     if (!data) {
         return {0,0,0,255};
     }
@@ -252,13 +340,14 @@ TGAColor TGAImage::get(int i) {
 }
 
 TGAColor TGAImage::get(int x, int y) {
-    if (!data || x<0 || y<0 || x>=width || y>=height) {
+    if ((!data && !mapping) || x<0 || y<0 || x>=width || y>=height) {
         return {0,0,0,255};
     }
-    return TGAColor(data+(x+y*width)*bytespp, bytespp);
+    return TGAColor(row(y)+x*bytespp, bytespp);
 }
 
 bool TGAImage::set(int x, int y, TGAColor &c) {
+    make_writable();
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
@@ -267,6 +356,7 @@ bool TGAImage::set(int x, int y, TGAColor &c) {
 }
 
 bool TGAImage::set(int x, int y, const TGAColor &c) {
+    make_writable();
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
@@ -274,19 +364,20 @@ bool TGAImage::set(int x, int y, const TGAColor &c) {
     return true;
 }
 
-int TGAImage::get_bytespp() {
+int TGAImage::get_bytespp() const {
     return bytespp;
 }
 
-int TGAImage::get_width() {
+int TGAImage::get_width() const {
     return width;
 }
 
-int TGAImage::get_height() {
+int TGAImage::get_height() const {
     return height;
 }
 
 bool TGAImage::flip_horizontally() {
+    make_writable();
     if (!data) return false;
     int half = width>>1;
     for (int i=0; i<half; i++) {
@@ -301,6 +392,7 @@ bool TGAImage::flip_horizontally() {
 }
 
 bool TGAImage::flip_vertically() {
+    make_writable();
     if (!data) return false;
     unsigned long bytes_per_line = width*bytespp;
     auto *line = new unsigned char[bytes_per_line];
@@ -317,14 +409,17 @@ bool TGAImage::flip_vertically() {
 }
 
 unsigned char *TGAImage::buffer() {
+    make_writable();
     return data;
 }
 
 void TGAImage::clear() {
+    make_writable();
     memset((void *)data, 0, width*height*bytespp);
 }
 
 bool TGAImage::scale(int w, int h) {
+    make_writable();
     if (w<=0 || h<=0 || !data) return false;
     auto *tdata = new unsigned char[w*h*bytespp];
     int nscanline = 0;
@@ -377,6 +472,7 @@ float* gaussian_kernel(const int radius) {
 }
 
 void TGAImage::gaussian_blur(const int radius) {
+    make_writable();
     float *kernel = gaussian_kernel(radius);
     TGAImage tmp(*this);
     int size = (radius*2)+1;
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <thread>
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int nthreads) {
+    // Spawns nthreads - 1 background workers; the caller is the last one.
+    // nthreads <= 0 means one per hardware thread.
+    if (nthreads <= 0) {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int i = 1; i < nthreads; ++i) {
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+int ThreadPool::size() const {
+    return static_cast<int>(workers.size()) + 1;
+}
+
+void ThreadPool::run_tasks(int worker) {
+    // Pulls task indices until there are none left
+    for (int task = next_task++; task < task_count; task = next_task++) {
+        job(task, worker);
+    }
+}
+
+void ThreadPool::worker_loop(int worker) {
+    unsigned long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        run_tasks(worker);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --busy_workers;
+        }
+        job_done.notify_one();
+    }
+}
+
+void ThreadPool::parallel_for(int count, std::function<void(int task, int worker)> fn) {
+    // Runs fn(task, worker) for every task in [0, count) and returns
+    // once all of them have finished. worker is in [0, size()) and
+    // can be used to index per-thread scratch data.
+    if (count <= 0) {
+        return;
+    }
+    bool idle = false;
+    if (workers.empty() || count == 1 || !dispatching.compare_exchange_strong(idle, true)) {
+        for (int task = 0; task < count; ++task) {
+            fn(task, 0);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = std::move(fn);
+        task_count = count;
+        next_task = 0;
+        busy_workers = static_cast<int>(workers.size());
+        ++generation;
+    }
+    job_ready.notify_all();
+    run_tasks(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [&]{ return busy_workers == 0; });
+    job = nullptr;
+    dispatching = false;
+}
+
+ThreadPool& render_pool() {
+    // The pool shared by the rasterizer and model loading, created on
+    // first use
+    static ThreadPool pool;
+    return pool;
+}
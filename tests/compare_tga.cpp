@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include "tgaimage.h"
+
+// Usage: compare_tga expected.tga actual.tga [max_differing_bytes]
+// Fails if the images differ in size or format, or in more than
+// max_differing_bytes bytes of pixel data, which defaults to 0.
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " expected.tga actual.tga [max_differing_bytes]\n";
+        return 2;
+    }
+    long allowed = argc > 3 ? std::atol(argv[3]) : 0;
+    TGAImage expected;
+    TGAImage actual;
+    if (!expected.read_tga_file(argv[1]) || !actual.read_tga_file(argv[2])) {
+        return 1;
+    }
+    if (expected.get_width() != actual.get_width() || expected.get_height() != actual.get_height()
+        || expected.get_bytespp() != actual.get_bytespp()) {
+        std::cerr << argv[2] << ": " << actual.get_width() << "x" << actual.get_height() << "/" << actual.get_bytespp()*8
+                  << ", expected " << expected.get_width() << "x" << expected.get_height() << "/" << expected.get_bytespp()*8 << "\n";
+        return 1;
+    }
+    long differing = 0;
+    int largest = 0;
+    long rowbytes = static_cast<long>(expected.get_width()) * expected.get_bytespp();
+    for (int y = 0; y < expected.get_height(); ++y) {
+        const unsigned char *a = expected.row(y);
+        const unsigned char *b = actual.row(y);
+        for (long i = 0; i < rowbytes; ++i) {
+            int difference = std::abs(a[i] - b[i]);
+            differing += difference != 0;
+            largest = std::max(largest, difference);
+        }
+    }
+    std::cout << argv[2] << ": " << differing << " bytes differ from " << argv[1] << ", by at most " << largest
+              << " (" << allowed << " allowed)\n";
+    return differing > allowed ? 1 : 0;
+}